@@ -0,0 +1,52 @@
+#ifndef LANG_SHAREDSTACK_HPP
+#define LANG_SHAREDSTACK_HPP
+
+#include <sys/mman.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstdlib>
+
+#define ANSI_COLOR_RED     "\x1b[31m"
+#define ANSI_COLOR_RESET   "\x1b[0m"
+
+// Operand stack in plain memory, so that native code can work with it through the shared stack pointer.
+// Generated code does not check bounds, a PROT_NONE page after the buffer turns an overflow into a fault.
+template <typename T>
+class SharedStack {
+public:
+    SharedStack(T*& sp, size_t capacity);
+    ~SharedStack() { munmap(base, length); }
+
+    void    push(const T& value) { if (sp == limit) fail("UNABLE TO PUSH IN FULL STACK"); *sp++ = value; }
+    void    pop()                { if (sp == base) fail("UNABLE TO POP FROM EMPTY STACK"); --sp; }
+    T       top()                { if (sp == base) fail("UNABLE TO GET TOP OF THE EMPTY STACK"); return sp[-1]; }
+    bool    empty()              { return sp == base; }
+    size_t  size()               { return sp - base; }
+
+private:
+    T*&    sp;
+    T*     base;
+    T*     limit;
+    size_t length;
+
+    static void fail(const char* descr) {
+        printf(ANSI_COLOR_RED "%s" ANSI_COLOR_RESET "\n", descr);
+        exit(1);
+    }
+};
+
+template <typename T>
+SharedStack<T>::SharedStack(T*& sp, size_t capacity) : sp(sp) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t data = (capacity * sizeof(T) + page - 1) / page * page;
+    length = data + page;
+    base = (T*)mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+        fail("UNABLE TO ALLOCATE REQUIRED SPACE");
+    }
+    mprotect((char*)base + data, page, PROT_NONE);
+    limit = (T*)((char*)base + data);
+    sp = base;
+}
+
+#endif //LANG_SHAREDSTACK_HPP
@@ -0,0 +1,127 @@
+#include "cfg.h"
+
+#include <algorithm>
+
+#include "codegen/opcodes.h"
+
+constexpr int OPCODE_COUNT = sizeof(OPCODE_ARGC) / sizeof(OPCODE_ARGC[0]);
+
+static bool is_command(int cell) {
+    return cell >= 0 && cell < OPCODE_COUNT;
+}
+
+static bool is_jump(Opcode op) {
+    return op == Opcode::jmp || op == Opcode::je || op == Opcode::jne || op == Opcode::jb || op == Opcode::ja ||
+           op == Opcode::jae || op == Opcode::jbe;
+}
+
+std::vector<BasicBlock> build_cfg(const int *code, int size) {
+    auto next = [&](int pc) { return is_command(code[pc]) ? pc + 1 + OPCODE_ARGC[code[pc]] : pc + 1; };
+    // Label argument of the command at pc, -1 if it lies outside the code (e.g. an import of an object).
+    auto target = [&](int pc) {
+        return pc + 1 < size && code[pc + 1] >= 0 && code[pc + 1] < size ? code[pc + 1] : -1;
+    };
+
+    std::vector<char> leader(size + 1);
+    leader[0] = true;
+    for (int pc = 0; pc < size; pc = next(pc)) {
+        if (!is_command(code[pc])) {
+            continue;
+        }
+        Opcode op = Opcode(code[pc]);
+        if ((is_jump(op) || op == Opcode::call) && target(pc) >= 0) {
+            leader[target(pc)] = true;
+        }
+        if (is_jump(op) || op == Opcode::ret || op == Opcode::end) {
+            leader[std::min(next(pc), size)] = true;
+        }
+    }
+
+    std::vector<BasicBlock> blocks;
+    std::vector<int> block_of(size, -1);
+    std::vector<int> last;  // pc of the last command of every block
+    for (int pc = 0; pc < size; pc = next(pc)) {
+        if (leader[pc]) {
+            blocks.push_back({pc, {}, {}});
+            last.push_back(pc);
+        }
+        block_of[pc] = blocks.size() - 1;
+        last.back() = pc;
+    }
+
+    for (size_t i = 0; i < blocks.size(); ++i) {
+        auto block_at = [&](int pc) { return pc >= 0 && pc < size ? block_of[pc] : -1; };
+        for (int pc = blocks[i].start; pc <= last[i]; pc = next(pc)) {
+            if (code[pc] == int(Opcode::call)) {
+                blocks[i].calls.push_back(block_at(target(pc)));
+            }
+        }
+        int end = last[i];
+        Opcode op = Opcode(code[end]);
+        bool command = is_command(code[end]);
+        if (command && is_jump(op)) {
+            blocks[i].successors.push_back(block_at(target(end)));
+        }
+        bool falls = !command || (op != Opcode::jmp && op != Opcode::ret && op != Opcode::end);
+        if (falls && i + 1 < blocks.size()) {
+            blocks[i].successors.push_back(i + 1);
+        }
+    }
+    return blocks;
+}
+
+void write_cfg(FILE *output, const std::vector<BasicBlock> &blocks) {
+    fprintf(output, "\n.cfg");
+    for (auto &block : blocks) {
+        fprintf(output, " %d %zu", block.start, block.successors.size());
+        for (int successor : block.successors) {
+            fprintf(output, " %d", successor);
+        }
+        fprintf(output, " %zu", block.calls.size());
+        for (int call : block.calls) {
+            fprintf(output, " %d", call);
+        }
+    }
+}
+
+std::vector<BasicBlock> read_cfg(const std::vector<int> &numbers) {
+    std::vector<BasicBlock> blocks;
+    size_t i = 0;
+    auto read_list = [&](std::vector<int> &list) {
+        size_t count = i < numbers.size() ? numbers[i++] : 0;
+        for (; count > 0 && i < numbers.size(); --count) {
+            list.push_back(numbers[i++]);
+        }
+    };
+    while (i < numbers.size()) {
+        BasicBlock block = {numbers[i++], {}, {}};
+        read_list(block.successors);
+        read_list(block.calls);
+        blocks.push_back(block);
+    }
+    return blocks;
+}
+
+void write_dot(FILE *output, const std::vector<BasicBlock> &blocks, int size, const std::map<int, std::string> &names) {
+    fprintf(output, "digraph cfg {\n"
+                    "    node [shape=box fontname=monospace];\n");
+    for (size_t i = 0; i < blocks.size(); ++i) {
+        int end = i + 1 < blocks.size() ? blocks[i + 1].start : size;
+        auto name = names.find(blocks[i].start);
+        std::string label = name != names.end() ? name->second : "b" + std::to_string(i);
+        fprintf(output, "    b%zu [label=\"%s\\npc %d-%d\"];\n", i, label.c_str(), blocks[i].start, end - 1);
+    }
+    for (size_t i = 0; i < blocks.size(); ++i) {
+        for (int successor : blocks[i].successors) {
+            if (successor >= 0) {
+                fprintf(output, "    b%zu -> b%d;\n", i, successor);
+            }
+        }
+        for (int call : blocks[i].calls) {
+            if (call >= 0) {
+                fprintf(output, "    b%zu -> b%d [style=dashed];\n", i, call);
+            }
+        }
+    }
+    fprintf(output, "}\n");
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <cstdio>
+#include <map>
+#include <string>
+#include <vector>
+
+//! \brief Straight-line code from start up to the start of the next block.
+struct BasicBlock {
+    int start;
+    std::vector<int> successors;  // blocks control goes to after the last command
+    std::vector<int> calls;       // blocks called from the block, -1 for a target outside the code
+};
+
+//! \brief Splits the code at jump and call targets and after jmp, conditional jumps, ret and end.
+//! \details A call does not end its block, control comes back to the next command.
+std::vector<BasicBlock> build_cfg(const int *code, int size);
+
+//! \brief Writes the .cfg section: for every block its start, the number of successors and the successors,
+//!        the number of calls and the called blocks.
+void write_cfg(FILE *output, const std::vector<BasicBlock> &blocks);
+
+//! \brief Reads the numbers following .cfg back into blocks.
+std::vector<BasicBlock> read_cfg(const std::vector<int> &numbers);
+
+//! \brief Graphviz graph of the blocks, calls are dashed. A block is named after the symbol at its start.
+void write_dot(FILE *output, const std::vector<BasicBlock> &blocks, int size, const std::map<int, std::string> &names);
@@ -1,7 +1,153 @@
 #include <unistd.h>
+#include <charconv>
+#include <map>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <cstdarg>
 
 #include "text_proc.h"
-#include "trie.cpp"
+#include "codegen/mnemonics.h"
+#include "codegen/opcodes.h"
+#include "codegen/version.h"
+#include "label_table.h"
+#include "object_cache.h"
+#include "cfg.h"
+
+// Objects with diagnostics are not cached, so the diagnostics show up on every build.
+static int diagnostics = 0;
+
+static void report(const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+    ++diagnostics;
+}
+
+// An image with undefined labels jumps to -1, so unlike other diagnostics they fail the build.
+static int undefined_labels = 0;
+
+static void report_undefined(int count) {
+    report("%d undefined label(s)\n", count);
+    undefined_labels += count;
+}
+
+//! \brief Consecutive words of the source encoded on their own.
+//! \details Labels go to the given table: LabelTable resolves them right away, PendingLabels only
+//!          collects pcs so that chunks assembled in parallel can be resolved after the merge.
+class Chunk {
+public:
+    const char *source;
+    span *text;
+    long long text_size;
+    int *compiled_text;
+
+    inline string_view word(long long pc) const { return {source + text[pc].offset, int(text[pc].len)}; }
+
+    //! \return Number of words encoded, less than text_size if the arguments of the last command lie beyond the chunk.
+    template <typename Labels>
+    long long encode(Labels &labels);
+};
+
+//! \brief Labels of a chunk, local pcs of definitions and of label arguments in order of appearance.
+struct PendingLabels {
+    std::vector<int> definitions;
+    std::vector<int> references;
+
+    bool define(const string_view &, int pc) {
+        definitions.push_back(pc);
+        return true;
+    }
+
+    int reference(const string_view &, int pc) {
+        references.push_back(pc);
+        return -1;
+    }
+};
+
+//! \brief Labels of a block of a streamed source.
+//! \details pcs are shifted by the words of the previous blocks. A reference to a label that is not defined yet
+//!          gets a placeholder in the output, its id is chained through links like LabelTable chains pcs.
+struct StreamLabels {
+    LabelTable &labels;
+    std::vector<int> &links;
+    long long base;
+    std::vector<int> forward;  // local pcs of the placeholders of the block
+
+    bool define(const string_view &name, int pc) {
+        return labels.define(name, base + pc);
+    }
+
+    int reference(const string_view &name, int pc) {
+        int target = labels.find(name);
+        if (target >= 0) {
+            return target;
+        }
+        forward.push_back(pc);
+        links.push_back(labels.reference(name, links.size()));
+        return -1;
+    }
+};
+
+template <typename Labels>
+long long Chunk::encode(Labels &labels) {
+    for (long long pc = 0; pc < text_size; ++pc) {
+        string_view current = word(pc);
+        if (current.ptr[0] == '$') {
+            if (!labels.define({current.ptr + 1, current.len - 1}, pc)) {
+                report("Duplicate label %.*s\n", current.len, current.ptr);
+            }
+            compiled_text[pc] = LABEL_CODE;
+            continue;
+        }
+        int current_lexeme = mnemonic_code(current.ptr, current.len);
+        compiled_text[pc] = current_lexeme;
+        if (current_lexeme >= 0 && pc + OPCODE_ARGC[current_lexeme] >= text_size) {
+            return pc;
+        }
+        // Get command arguments
+        switch (current_lexeme) {
+#include "codegen/compile.cpp"
+        }
+    }
+    return text_size;
+}
+
+//! \brief Command of a peephole rule, its arguments are literal values or captures.
+struct PeepholeCommand {
+    Opcode opcode;
+    std::vector<int> args;
+};
+
+// Values from CAPTURE up are captures: one matches any value, but the same value wherever it repeats in a rule.
+// In a replacement, a capture with NEGATED set stands for the negated value.
+constexpr int CAPTURE = 1 << 30;
+constexpr int NEGATED = 1 << 20;
+constexpr int X = CAPTURE, Y = CAPTURE + 1, K = CAPTURE + 2;
+constexpr int CAPTURE_COUNT = 3;
+
+//! \brief Sequence of commands and a shorter one doing the same to registers and to the operand stack.
+struct PeepholeRule {
+    std::vector<PeepholeCommand> match;
+    std::vector<PeepholeCommand> replacement;
+};
+
+//! \details Tried in order, so a rule goes before the rules matching its prefix.
+static const std::vector<PeepholeRule> PEEPHOLE_RULES = {
+    // rX = rX + K
+    {{{Opcode::pushr, {X}}, {Opcode::push, {K}}, {Opcode::add, {}}, {Opcode::popr, {X}}}, {{Opcode::addi, {X, K}}}},
+    {{{Opcode::push, {K}}, {Opcode::pushr, {X}}, {Opcode::add, {}}, {Opcode::popr, {X}}}, {{Opcode::addi, {X, K}}}},
+    // rX = rX - K
+    {{{Opcode::pushr, {X}}, {Opcode::push, {K}}, {Opcode::sub, {}}, {Opcode::popr, {X}}},
+     {{Opcode::addi, {X, K | NEGATED}}}},
+    // rX = K
+    {{{Opcode::push, {K}}, {Opcode::popr, {X}}}, {{Opcode::movi, {X, K}}}},
+    // rY = rX
+    {{{Opcode::pushr, {X}}, {Opcode::popr, {Y}}}, {{Opcode::mov, {Y, X}}}},
+};
 
 class Compiler {
 public:
@@ -9,124 +155,584 @@ public:
 
     ~Compiler() {
         if (text) free(text);
+        unmap_input(source, source_size);
         if (compiled_text) free(compiled_text);
     }
 
     void compile(const char *OUTPUT_FILE, const char *INPUT_FILE);
 
+    //! \brief Same code followed by the symbol tables, labels defined elsewhere are left to the linker.
+    void compile_object(const char *OUTPUT_FILE, const char *INPUT_FILE);
+
+    //! \brief Same output as compile, chunks of the source are tokenized, encoded and patched by jobs threads.
+    void compile(const char *OUTPUT_FILE, const char *INPUT_FILE, int jobs);
+
+    //! \brief Assembles a source read from a descriptor (e.g. a pipe) block by block.
+    //! \details Only the label table and forward references stay in memory. Cells of forward references are
+    //!          written as placeholders and patched in the output file once the input ends.
+    //! \return false if the output can't be patched in place (e.g. it is a pipe), nothing is read then.
+    bool compile_stream(const char *OUTPUT_FILE, int input);
+
     void list(const char *OUTPUT_FILE, const char *INPUT_FILE);
 
     void dissasm(const char *OUTPUT_FILE, const char *INPUT_FILE);
 
+    //! \brief compile and compile_object run the code through the peephole rules.
+    void enable_peephole() { peephole = true; }
+
+    //! \brief compile and compile_object append .symbols and .lines to their output.
+    void enable_debug_info() { debug_info = true; }
+
+    //! \brief compile and compile_object append the .cfg section to their output.
+    void enable_flow_graph() { flow_graph = true; }
+
+    //! \brief Writes the control flow graph of an object as a dot file, from its .cfg if it has one.
+    void flow_graph_dot(const char *OUTPUT_FILE, const char *INPUT_FILE);
+
 private:
     int pc;
     int size;
-    Trie command_trie;
-    Trie label_trie;
+    LabelTable labels;
     int *compiled_text;
     size_t text_size;
-    string_view *text;
-    const int LABEL_CODE = 14631;
+    span *text;
+    // Words and labels point into the mapped source, so it lives as long as the compiler.
+    const char *source;
+    long long source_size;
+    bool peephole;
+    bool debug_info;
+    bool flow_graph;
+
+    inline string_view word(int pc) const { return {source + text[pc].offset, int(text[pc].len)}; }
+
+    inline bool is_command(int pc) const {
+        return compiled_text[pc] >= 0 && compiled_text[pc] < int(sizeof(OPCODE_ARGC) / sizeof(OPCODE_ARGC[0]));
+    }
+
+    //! \return pc of the command or label following the one at pc.
+    inline int next(int pc) const { return is_command(pc) ? pc + 1 + OPCODE_ARGC[compiled_text[pc]] : pc + 1; }
+
+    //! \return true if pc holds a label and the label table points at it (not at an earlier duplicate).
+    inline bool is_first_definition(int pc) const {
+        return compiled_text[pc] == LABEL_CODE && labels.find({word(pc).ptr + 1, word(pc).len - 1}) == pc;
+    }
 
-    inline bool is_label(const string_view &word) { return word.ptr[0] == '$'; }
+    void write_debug_info(FILE *compiled, const char *INPUT_FILE);
 
-    int get_lexeme(const string_view &word);
+    void assemble(const char *INPUT_FILE, bool relocatable = false);
+
+    //! \return Number of cells the rule matches at pc, 0 if it does not match.
+    int match(const PeepholeRule &rule, int pc, int *captures) const;
+
+    void optimize();
 };
 
-Compiler::Compiler() : pc(0), size(0), compiled_text(nullptr), text_size(0), text(nullptr) {
-#include "codegen/create_trie.cpp"
-}
+Compiler::Compiler() : pc(0), size(0), compiled_text(nullptr), text_size(0), text(nullptr), source(nullptr),
+                       source_size(0), peephole(false), debug_info(false),
+                       flow_graph(false) {}
 
 void Compiler::compile(const char *OUTPUT_FILE, const char *INPUT_FILE) {
-    char *initial_text = nullptr;
     auto compiled = fopen(OUTPUT_FILE, "w");
-    long long SIZE = read_input(INPUT_FILE, initial_text);
-    text_size = separate_by_words(initial_text, SIZE, text);
-    // First stage
-    for (pc = 0; pc < text_size; ++pc) {
-        if (is_label(text[pc])) {
-            label_trie.insert({text[pc].ptr + 1, text[pc].len - 1}, pc);
+    assemble(INPUT_FILE);
+    if (peephole) {
+        optimize();
+    }
+    for (int i = 0; i < text_size; ++i) {
+        fprintf(compiled, "%d ", compiled_text[i]);
+    }
+    if (debug_info) {
+        write_debug_info(compiled, INPUT_FILE);
+    }
+    if (flow_graph) {
+        write_cfg(compiled, build_cfg(compiled_text, text_size));
+    }
+    if (debug_info || flow_graph) {
+        fprintf(compiled, "\n");
+    }
+    fclose(compiled);
+}
+
+//! \details Sections for tools, execute skips them:
+//!          .symbols name pc ...     - every label (the first definition of each),
+//!          .lines "file" pc line ... - line of the file at the pcs where it changes, the rest of the pcs
+//!                                     share the line of the closest pc before them. The file is quoted
+//!                                     by write_quoted, so it is one word and never a number.
+void Compiler::write_debug_info(FILE *compiled, const char *INPUT_FILE) {
+    fprintf(compiled, "\n.symbols");
+    for (int pc = 0; pc < text_size; pc = next(pc)) {
+        if (is_first_definition(pc)) {
+            fprintf(compiled, " %.*s %d", word(pc).len - 1, word(pc).ptr + 1, pc);
         }
     }
-    // Second stage
-    compiled_text = (int *) calloc(text_size, sizeof(int));
-    this->size = text_size;
-    for (pc = 0; pc < text_size; ++pc) {
-        uint64_t current_lexeme = get_lexeme(text[pc]);
-        compiled_text[pc] = current_lexeme;
-        // Get command arguments
-        string_view tmp;
-        switch (current_lexeme) {
-#include "codegen/compile.cpp"
+    fprintf(compiled, "\n.lines ");
+    write_quoted(compiled, INPUT_FILE);
+    int line = 1;
+    int last_line = 0;
+    const char *counted = source;
+    for (int pc = 0; pc < text_size; pc = next(pc)) {
+        line += std::count(counted, source + text[pc].offset, '\n');
+        counted = source + text[pc].offset;
+        if (line != last_line) {
+            fprintf(compiled, " %d %d", pc, line);
+            last_line = line;
         }
     }
+}
+
+//! \details The code is followed by sections, each starts with a word beginning with '.':
+//!          .exports name pc ...  - labels defined here (the first definition of each),
+//!          .imports name pc ...  - cells referencing labels that are not defined here,
+//!          .relocations pc ...   - cells holding pcs of this object, they move with it.
+void Compiler::compile_object(const char *OUTPUT_FILE, const char *INPUT_FILE) {
+    auto compiled = fopen(OUTPUT_FILE, "w");
+    assemble(INPUT_FILE, true);
+    if (peephole) {
+        optimize();
+    }
     for (int i = 0; i < text_size; ++i) {
         fprintf(compiled, "%d ", compiled_text[i]);
     }
+
+    auto label_arguments = [&](int pc, auto visit) {
+        for (int arg = pc + 1; is_command(pc) && arg < next(pc) && arg < text_size; ++arg) {
+            if (OPCODE_ARGTYPE[compiled_text[pc]][arg - pc - 1] == 2) {
+                visit(arg);
+            }
+        }
+    };
+
+    fprintf(compiled, "\n.exports");
+    for (int pc = 0; pc < text_size; pc = next(pc)) {
+        if (is_first_definition(pc)) {
+            fprintf(compiled, " %.*s %d", word(pc).len - 1, word(pc).ptr + 1, pc);
+        }
+    }
+    fprintf(compiled, "\n.imports");
+    for (int pc = 0; pc < text_size; pc = next(pc)) {
+        label_arguments(pc, [&](int arg) {
+            if (compiled_text[arg] == -1) {
+                fprintf(compiled, " %.*s %d", word(arg).len, word(arg).ptr, arg);
+            }
+        });
+    }
+    fprintf(compiled, "\n.relocations");
+    for (int pc = 0; pc < text_size; pc = next(pc)) {
+        label_arguments(pc, [&](int arg) {
+            if (compiled_text[arg] != -1) {
+                fprintf(compiled, " %d", arg);
+            }
+        });
+    }
+    if (debug_info) {
+        write_debug_info(compiled, INPUT_FILE);
+    }
+    if (flow_graph) {
+        write_cfg(compiled, build_cfg(compiled_text, text_size));
+    }
+    fprintf(compiled, "\n");
     fclose(compiled);
 }
 
-int Compiler::get_lexeme(const string_view &word) {
-    if (is_label(word)) {
-        return LABEL_CODE;
+//! \brief Runs job(i) for every i in [0, jobs) on its own thread and waits for all of them.
+template <typename Job>
+static void parallel(int jobs, Job job) {
+    std::vector<std::thread> threads;
+    for (int i = 0; i < jobs; ++i) {
+        threads.emplace_back(job, i);
+    }
+    for (auto &thread : threads) {
+        thread.join();
     }
-    return command_trie.get_code(word);
 }
 
+//! \details Chunks end at line boundaries. Every thread tokenizes and encodes its chunk collecting PendingLabels,
+//!          then definitions are merged in source order, so the first one wins as in the single pass,
+//!          and every thread patches its references and formats its part of the output.
+//!          If the arguments of a command continue in the next chunk, the whole file is assembled by compile.
+void Compiler::compile(const char *OUTPUT_FILE, const char *INPUT_FILE, int jobs) {
+    source_size = map_input(INPUT_FILE, source);
+    std::vector<Chunk> chunks(jobs);
+    std::vector<long long> chunk_sizes(jobs);
+    long long begin = 0;
+    for (int i = 0; i < jobs; ++i) {
+        long long end = i + 1 == jobs ? source_size : std::max(begin, source_size / jobs * (i + 1));
+        while (end > 0 && end < source_size && source[end - 1] != '\n') {
+            ++end;
+        }
+        chunks[i].source = source + begin;
+        chunk_sizes[i] = end - begin;
+        begin = end;
+    }
+
+    std::vector<PendingLabels> pending(jobs);
+    std::vector<char> complete(jobs);
+    parallel(jobs, [&](int i) {
+        Chunk &chunk = chunks[i];
+        chunk.text_size = tokenize(chunk.source, chunk_sizes[i], chunk.text);
+        chunk.compiled_text = (int *) calloc(chunk.text_size, sizeof(int));
+        complete[i] = chunk.encode(pending[i]) == chunk.text_size;
+    });
+    auto release = [&]() {
+        for (auto &chunk : chunks) {
+            free(chunk.text);
+            free(chunk.compiled_text);
+        }
+    };
+    if (std::count(complete.begin(), complete.end(), true) != jobs) {
+        release();
+        unmap_input(source, source_size);
+        source = nullptr;
+        compile(OUTPUT_FILE, INPUT_FILE);
+        return;
+    }
+
+    std::vector<long long> base(jobs);
+    long long total = 0;
+    for (int i = 0; i < jobs; ++i) {
+        base[i] = total;
+        total += chunks[i].text_size;
+        for (int pc : pending[i].definitions) {
+            string_view current = chunks[i].word(pc);
+            if (!labels.define({current.ptr + 1, current.len - 1}, base[i] + pc)) {
+                report("Duplicate label %.*s\n", current.len, current.ptr);
+            }
+        }
+    }
+
+    // Up to 11 characters of an int and a space per word.
+    const int CELL_WIDTH = 12;
+    std::vector<std::vector<string_view>> undefined(jobs);
+    std::vector<char *> output(jobs);
+    std::vector<size_t> output_sizes(jobs);
+    parallel(jobs, [&](int i) {
+        Chunk &chunk = chunks[i];
+        for (int pc : pending[i].references) {
+            chunk.compiled_text[pc] = labels.find(chunk.word(pc));
+            if (chunk.compiled_text[pc] < 0) {
+                undefined[i].push_back(chunk.word(pc));
+            }
+        }
+        output[i] = (char *) malloc(chunk.text_size * CELL_WIDTH + 1);
+        char *end = output[i];
+        for (long long pc = 0; pc < chunk.text_size; ++pc) {
+            end = std::to_chars(end, end + CELL_WIDTH, chunk.compiled_text[pc]).ptr;
+            *end++ = ' ';
+        }
+        output_sizes[i] = end - output[i];
+    });
+
+    LabelTable reported;
+    int undefined_count = 0;
+    for (auto &names : undefined) {
+        for (auto &name : names) {
+            undefined_count += reported.define(name, 0);
+        }
+    }
+    if (undefined_count) {
+        report_undefined(undefined_count);
+    }
+
+    auto compiled = fopen(OUTPUT_FILE, "w");
+    for (int i = 0; i < jobs; ++i) {
+        fwrite(output[i], 1, output_sizes[i], compiled);
+        free(output[i]);
+    }
+    fclose(compiled);
+    release();
+}
+
+bool Compiler::compile_stream(const char *OUTPUT_FILE, int input) {
+    const long long BLOCK_SIZE = 1 << 16;
+    // Wide enough for any pc and for -1 of an undefined label.
+    const int PLACEHOLDER_WIDTH = 10;
+    long long capacity = BLOCK_SIZE;
+    char *buffer = (char *) malloc(capacity); assert(buffer);
+    long long filled = 0;
+    LabelTable stream_labels(1024, true);
+    std::vector<int> links;
+    std::vector<long long> offsets;
+    long long base = 0;
+    long long written = 0;
+    auto compiled = fopen(OUTPUT_FILE, "w");
+    if (!compiled || lseek(fileno(compiled), 0, SEEK_CUR) < 0) {
+        fprintf(stderr, "%s is not a seekable file, forward labels of a stream are patched in it\n", OUTPUT_FILE);
+        if (compiled) {
+            fclose(compiled);
+        }
+        free(buffer);
+        return false;
+    }
+    for (bool eof = false; !eof;) {
+        // A command longer than the free space of the buffer is kept whole, so the buffer grows.
+        if (capacity - filled < BLOCK_SIZE) {
+            capacity *= 2;
+            buffer = (char *) realloc(buffer, capacity); assert(buffer);
+        }
+        ssize_t got = read(input, buffer + filled, capacity - filled); assert(got >= 0);
+        eof = got == 0;
+        filled += got;
+
+        span *words = nullptr;
+        long long words_number = tokenize(buffer, filled, words);
+        long long complete_words = words_number;
+        if (!eof && complete_words > 0 && !isspace(buffer[filled - 1])) {
+            --complete_words;
+        }
+        int *code = (int *) calloc(complete_words, sizeof(int));
+        StreamLabels block_labels = {stream_labels, links, base, {}};
+        Chunk chunk = {buffer, words, complete_words, code};
+        long long encoded = chunk.encode(block_labels);
+        if (eof && encoded != complete_words) {
+            report("Arguments of %.*s missing at the end\n", chunk.word(encoded).len, chunk.word(encoded).ptr);
+            encoded = complete_words;
+        }
+
+        size_t next_forward = 0;
+        for (long long pc = 0; pc < encoded; ++pc) {
+            char cell[PLACEHOLDER_WIDTH + 1];
+            char *end = cell;
+            if (next_forward < block_labels.forward.size() && block_labels.forward[next_forward] == pc) {
+                offsets.push_back(written);
+                ++next_forward;
+                end = std::fill_n(end, PLACEHOLDER_WIDTH, ' ');
+            } else {
+                end = std::to_chars(end, cell + PLACEHOLDER_WIDTH + 1, code[pc]).ptr;
+            }
+            *end++ = ' ';
+            fwrite(cell, 1, end - cell, compiled);
+            written += end - cell;
+        }
+        base += encoded;
+
+        long long keep_from = encoded < words_number ? words[encoded].offset : filled;
+        memmove(buffer, buffer + keep_from, filled - keep_from);
+        filled -= keep_from;
+        free(words);
+        free(code);
+    }
+    free(buffer);
+
+    fflush(compiled);
+    if (int undefined = stream_labels.patch(links.data())) {
+        report_undefined(undefined);
+    }
+    for (size_t id = 0; id < links.size(); ++id) {
+        char cell[PLACEHOLDER_WIDTH + 1];
+        snprintf(cell, sizeof(cell), "%-*d", PLACEHOLDER_WIDTH, links[id]);
+        if (pwrite(fileno(compiled), cell, PLACEHOLDER_WIDTH, offsets[id]) != PLACEHOLDER_WIDTH) {
+            fprintf(stderr, "Can't patch %s\n", OUTPUT_FILE);
+            fclose(compiled);
+            return false;
+        }
+    }
+    fclose(compiled);
+    return true;
+}
+
+//! \details Single pass: labels are defined as they appear, forward references are backpatched at the end.
+void Compiler::assemble(const char *INPUT_FILE, bool relocatable) {
+    source_size = map_input(INPUT_FILE, source);
+    text_size = tokenize(source, source_size, text);
+    compiled_text = (int *) calloc(text_size, sizeof(int));
+    this->size = text_size;
+    Chunk whole = {source, text, (long long) text_size, compiled_text};
+    long long encoded = whole.encode(labels);
+    if (encoded != text_size) {
+        report("Arguments of %.*s missing at the end\n", whole.word(encoded).len, whole.word(encoded).ptr);
+    }
+    int undefined = labels.patch(compiled_text);
+    if (undefined && !relocatable) {
+        report_undefined(undefined);
+    }
+}
+
+int Compiler::match(const PeepholeRule &rule, int pc, int *captures) const {
+    bool bound[CAPTURE_COUNT] = {};
+    int at = pc;
+    for (auto &command : rule.match) {
+        assert(int(command.args.size()) == OPCODE_ARGC[int(command.opcode)]);
+        if (at + int(command.args.size()) >= text_size || compiled_text[at] != int(command.opcode)) {
+            return 0;
+        }
+        for (int value : command.args) {
+            int actual = compiled_text[++at];
+            if (value < CAPTURE) {
+                if (value != actual) {
+                    return 0;
+                }
+            } else if (!bound[value - CAPTURE]) {
+                bound[value - CAPTURE] = true;
+                captures[value - CAPTURE] = actual;
+            } else if (captures[value - CAPTURE] != actual) {
+                return 0;
+            }
+        }
+        ++at;
+    }
+    return at - pc;
+}
+
+//! \details Rules are tried at every command. A label is not a command of any rule, so a matched sequence
+//!          never contains one, and since jumps and calls only land on labels, none lands inside the sequence.
+//!          The code is compacted in place, then label arguments and the label table move to the new pcs.
+void Compiler::optimize() {
+    std::vector<int> moved(text_size);
+    int captures[CAPTURE_COUNT];
+    int end = 0;
+    for (int pc = 0; pc < text_size;) {
+        moved[pc] = end;
+        int matched = 0;
+        const PeepholeRule *rule = nullptr;
+        for (auto &candidate : PEEPHOLE_RULES) {
+            if ((matched = match(candidate, pc, captures))) {
+                rule = &candidate;
+                break;
+            }
+        }
+        if (!rule) {
+            for (int last = std::min<int>(next(pc), text_size); pc < last; ++pc, ++end) {
+                compiled_text[end] = compiled_text[pc];
+                text[end] = text[pc];
+            }
+            continue;
+        }
+        int start = end;
+        for (auto &command : rule->replacement) {
+            compiled_text[end++] = int(command.opcode);
+            for (int value : command.args) {
+                int argument = value < CAPTURE ? value : captures[(value & ~NEGATED) - CAPTURE];
+                // Negated as unsigned, so that INT_MIN wraps like the subtraction it replaces.
+                compiled_text[end++] = value >= CAPTURE && (value & NEGATED) ? int(0u - unsigned(argument)) : argument;
+            }
+        }
+        assert(end - start <= matched);
+        for (int i = start; i < end; ++i) {
+            text[i] = text[pc];
+        }
+        pc += matched;
+    }
+    text_size = end;
+    size = end;
+
+    labels = LabelTable();
+    for (int pc = 0; pc < text_size; pc = next(pc)) {
+        if (compiled_text[pc] == LABEL_CODE) {
+            labels.define({word(pc).ptr + 1, word(pc).len - 1}, pc);
+        }
+        for (int arg = pc + 1; is_command(pc) && arg < next(pc) && arg < text_size; ++arg) {
+            if (OPCODE_ARGTYPE[compiled_text[pc]][arg - pc - 1] == 2 && compiled_text[arg] >= 0) {
+                compiled_text[arg] = moved[compiled_text[arg]];
+            }
+        }
+    }
+}
+
+//! \details Labels are named after .symbols and label arguments of an object after .imports,
+//!          the rest of the labels become labelN (N counts labels from the start).
 void Compiler::dissasm(const char *OUTPUT_FILE, const char *INPUT_FILE) {
     auto intial = fopen(OUTPUT_FILE, "w");
     int label_cnt = 0;
-    char *raw_compiled_text = nullptr;
-    string_view *compiled_string_view = nullptr;
-    long long SIZE = read_input(INPUT_FILE, raw_compiled_text);
-    text_size = separate_strings(raw_compiled_text, SIZE, compiled_string_view);
+    const char *raw_compiled_text = nullptr;
+    span *compiled_spans = nullptr;
+    long long SIZE = map_input(INPUT_FILE, raw_compiled_text);
+    long long words_number = tokenize(raw_compiled_text, SIZE, compiled_spans);
+    text_size = code_size(raw_compiled_text, compiled_spans, words_number);
     compiled_text = (int *) calloc(text_size, sizeof(int));
+    auto raw_word = [&](long long i) {
+        return std::string_view(raw_compiled_text + compiled_spans[i].offset, compiled_spans[i].len);
+    };
     for (long long i = 0; i < text_size; ++i) {
-        compiled_text[i] = strtol(compiled_string_view[i].ptr, NULL, 10);
+        compiled_text[i] = parse_int(raw_word(i).data(), raw_word(i).size());
+    }
+
+    std::map<int, std::string> label_names;
+    std::map<int, std::string> imports;
+    std::string_view section;
+    for (long long i = text_size; i < words_number; ++i) {
+        if (raw_word(i)[0] == '.') {
+            section = raw_word(i);
+        } else if ((section == ".symbols" || section == ".imports") && i + 1 < words_number) {
+            auto &names = section == ".symbols" ? label_names : imports;
+            names.emplace(parse_int(raw_word(i + 1).data(), raw_word(i + 1).size()), raw_word(i));
+            ++i;
+        }
     }
     for (pc = 0; pc < text_size; ++pc) {
         if (compiled_text[pc] == LABEL_CODE) {
-            compiled_text[pc] = 0b10000000 + label_cnt++;
+            label_names.emplace(pc, "label" + std::to_string(label_cnt++));
         }
     }
+    auto label_argument = [&](int cell) {
+        int target = compiled_text[cell];
+        if (imports.contains(cell)) {
+            return imports[cell];
+        }
+        return label_names.contains(target) ? label_names[target] : std::to_string(target);
+    };
+
     for (pc = 0; pc < text_size; ++pc) {
         uint64_t current_command = compiled_text[pc];
-        // Get command arguments
-        if (compiled_text[pc] & 0b10000000) {
-            fprintf(intial, "$label%d\n", compiled_text[pc] & 0b1111);
+        if (compiled_text[pc] == LABEL_CODE) {
+            fprintf(intial, "$%s\n", label_names[pc].c_str());
             continue;
         }
+        // Get command arguments
         switch (current_command) {
 #include "codegen/disassembly.cpp"
         }
     }
-    free(raw_compiled_text);
+    unmap_input(raw_compiled_text, SIZE);
+    free(compiled_spans);
     free(compiled_text);
+    compiled_text = nullptr;
+    fclose(intial);
 }
 
-void Compiler::list(const char *OUTPUT_FILE, const char *INPUT_FILE) {
-    char *initial_text = nullptr;
-    auto listing = fopen(OUTPUT_FILE, "w");
-    long long SIZE = read_input(INPUT_FILE, initial_text);
-    text_size = separate_strings(initial_text, SIZE, text);
-    // First stage
-    for (pc = 0; pc < text_size; ++pc) {
-        if (is_label(text[pc])) {
-            label_trie.insert({text[pc].ptr + 1, text[pc].len - 1}, pc);
+void Compiler::flow_graph_dot(const char *OUTPUT_FILE, const char *INPUT_FILE) {
+    const char *object = nullptr;
+    span *words = nullptr;
+    long long SIZE = map_input(INPUT_FILE, object);
+    long long words_number = tokenize(object, SIZE, words);
+    text_size = code_size(object, words, words_number);
+    auto raw_word = [&](long long i) { return std::string_view(object + words[i].offset, words[i].len); };
+    auto number = [&](long long i) { return parse_int(raw_word(i).data(), raw_word(i).size()); };
+
+    std::map<int, std::string> names;
+    std::vector<int> cfg;
+    bool has_cfg = false;
+    std::string_view section;
+    for (long long i = text_size; i < words_number; ++i) {
+        if (raw_word(i)[0] == '.') {
+            section = raw_word(i);
+            has_cfg |= section == ".cfg";
+        } else if (section == ".symbols" && i + 1 < words_number) {
+            names.emplace(number(i + 1), raw_word(i));
+            ++i;
+        } else if (section == ".cfg") {
+            cfg.push_back(number(i));
         }
     }
-    // Second stage
-    compiled_text = (int *) calloc(text_size, sizeof(int));
-    this->size = text_size;
-    for (pc = 0; pc < text_size; ++pc) {
-        uint64_t current_lexeme = get_lexeme(text[pc]);
-        compiled_text[pc] = current_lexeme;
-        // Get command arguments
-        string_view tmp;
-        switch (current_lexeme) {
-#include "codegen/compile.cpp"
+    std::vector<BasicBlock> blocks;
+    if (has_cfg) {
+        blocks = read_cfg(cfg);
+    } else {
+        std::vector<int> code(text_size);
+        for (long long i = 0; i < text_size; ++i) {
+            code[i] = number(i);
         }
+        blocks = build_cfg(code.data(), text_size);
     }
+
+    auto dot = fopen(OUTPUT_FILE, "w");
+    write_dot(dot, blocks, text_size, names);
+    fclose(dot);
+    unmap_input(object, SIZE);
+    free(words);
+}
+
+void Compiler::list(const char *OUTPUT_FILE, const char *INPUT_FILE) {
+    auto listing = fopen(OUTPUT_FILE, "w");
+    assemble(INPUT_FILE);
     int pc1 = 0;
     int pc2 = 0;
     for (int pc1 = 0; pc1 < text_size; ++pc1, ++pc2) {
@@ -135,7 +741,6 @@ void Compiler::list(const char *OUTPUT_FILE, const char *INPUT_FILE) {
 #include "codegen/listing.cpp"
         }
     }
-    free(initial_text);
     fclose(listing);
 }
 
@@ -148,11 +753,46 @@ int main(int argc, char **argv) {
     char *input_filename = default_input;
     int key = 0;
     bool listing = false;
-    while ((key = getopt(argc, argv, ":o:i:l")) != -1) {
+    bool disassembly = false;
+    bool object = false;
+    bool cached = true;
+    bool optimized = false;
+    bool debug_info = false;
+    bool flow_graph = false;
+    bool flow_graph_dot = false;
+    int jobs = 1;
+    while ((key = getopt(argc, argv, ":o:i:ldj:cnOgfF")) != -1) {
         switch (key) {
             case 'l':
                 listing = true;
                 break;
+            case 'd':
+                disassembly = true;
+                break;
+            case 'j':
+                jobs = std::max(1, atoi(optarg));
+                break;
+            case 'c':
+                object = true;
+                break;
+            case 'n':
+                cached = false;
+                break;
+            case 'O':
+                optimized = true;
+                compiler.enable_peephole();
+                break;
+            case 'g':
+                debug_info = true;
+                compiler.enable_debug_info();
+                break;
+            case 'f':
+                flow_graph = true;
+                compiler.enable_flow_graph();
+                break;
+            case 'F':
+                flow_graph_dot = true;
+                break;
             case 'o':
                 output_filename = optarg;
                 break;
@@ -168,6 +808,50 @@ int main(int argc, char **argv) {
         compiler.list("listing", input_filename);
         return 0;
     }
-    compiler.compile(output_filename, input_filename);
-    return 0;
+    if (disassembly) {
+        compiler.dissasm(output_filename, input_filename);
+        return 0;
+    }
+    if (flow_graph_dot) {
+        compiler.flow_graph_dot(output_filename, input_filename);
+        return 0;
+    }
+    if (!strcmp(input_filename, "-")) {
+        // These need the whole text at once, a stream is only held block by block.
+        if (object || optimized || debug_info || flow_graph) {
+            fprintf(stderr, "-c, -O, -g and -f can't be used with - (stdin), give the input as a file\n");
+            return 1;
+        }
+        return compiler.compile_stream(output_filename, STDIN_FILENO) && !undefined_labels ? 0 : 1;
+    }
+
+    // -j gives the same output, so it is not a part of the key. The peephole pass, the debug info
+    // and the flow graph need the whole text. The line table names the input, so with -g it is in the key.
+    ObjectCache cache;
+    CacheKey input_key = {};
+    if (cached && cache.enabled()) {
+        const char *text = nullptr;
+        long long size = map_input(input_filename, text);
+        // The executable covers every source and option of the build, TOOLCHAIN_VERSION is left if it can't be read.
+        CacheKey executable = {};
+        std::string toolchain = executable_key(executable) ? executable.hex() : TOOLCHAIN_VERSION;
+        input_key = cache_key(text, size, toolchain + (object ? " -c" : "") + (optimized ? " -O" : "") +
+                                          (flow_graph ? " -f" : "") +
+                                          (debug_info ? std::string(" -g ") + input_filename : ""));
+        unmap_input(text, size);
+        if (cache.fetch(input_key, output_filename)) {
+            return 0;
+        }
+    }
+    if (object) {
+        compiler.compile_object(output_filename, input_filename);
+    } else if (jobs > 1 && !optimized && !debug_info && !flow_graph) {
+        compiler.compile(output_filename, input_filename, jobs);
+    } else {
+        compiler.compile(output_filename, input_filename);
+    }
+    if (cached && cache.enabled() && !diagnostics) {
+        cache.store(input_key, output_filename);
+    }
+    return undefined_labels ? 1 : 0;
 }
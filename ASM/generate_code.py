@@ -1,12 +1,15 @@
+import hashlib
 import os
 
 CODEGEN_DIR = "codegen"
 COMMANDS_PATH = "commands.txt"
 EXECUTE_PATH = "execute.cpp"
 COMPILE_PATH = "compile.cpp"
-CREATE_TRIE_PATH = "create_trie.cpp"
+MNEMONICS_PATH = "mnemonics.h"
 DISSASEMBLY_PATH = "disassembly.cpp"
 LISTING_PATH = "listing.cpp"
+OPCODES_PATH = "opcodes.h"
+VERSION_PATH = "version.h"
 
 def generate_file(path):
     if not os.path.exists(CODEGEN_DIR):
@@ -18,63 +21,75 @@ def generate_file(path):
 commands = open(COMMANDS_PATH, 'r')
 execute = generate_file(EXECUTE_PATH)
 compile = generate_file(COMPILE_PATH)
-create_trie = generate_file(CREATE_TRIE_PATH)
+mnemonics = generate_file(MNEMONICS_PATH)
 disassembly = generate_file(DISSASEMBLY_PATH)
 listing = generate_file(LISTING_PATH)
+opcodes = generate_file(OPCODES_PATH)
 
+opcodes.write("#pragma once\n\n"
+              "enum class Opcode {\n")
+opcodes_argc = []
+opcodes_argtype = []
+opcodes_name = []
+mnemonic_codes = {}
+
+ARG_READERS = ["parse_int(word(pc).ptr, word(pc).len)",
+               "parse_int(word(pc).ptr + 1, word(pc).len - 1)",
+               "labels.reference(word(pc), pc)"]
+ARG_FORMATS = ["\" %d\", compiled_text[pc]",
+               "\" r%d\", compiled_text[pc]",
+               "\" %s\", label_argument(pc).c_str()"]
+OPCODE_MAX_ARGC = 2
+# Cell of a label definition, any number that is not an opcode would do.
+LABEL_CODE = 14631
 
 for line in commands:
-    # data[0] - name, data[1] - code, data[2] - argc, data[3] - arg == reg?
+    # data[0] - name, data[1] - code, data[2] - argc,
+    # data[3] - type of the arguments (0 - integer, 1 - register, 2 - label), one digit for all or one per argument
     data = line.split()
-    
+    argc = int(data[2])
+    argtypes = [int(t) for t in (data[3] * argc if len(data[3]) == 1 else data[3])]
+    assert len(argtypes) == argc <= OPCODE_MAX_ARGC
+    # Tables such as OPCODE_ARGC are indexed by the code, so the codes go 0, 1, 2... in this order.
+    assert int(data[1]) == len(opcodes_argc), f"{data[0]} has code {data[1]}, expected {len(opcodes_argc)}"
+
     # Generate execute file
     execute.write(f"case {data[1]}: {{\n"
                   f"\t{data[0]}();\n"
                   f"\tbreak;\n}}\n")
 
+    # Generate opcode enumeration
+    opcodes.write(f"    {data[0]} = {data[1]},\n")
+    opcodes_argc.append(data[2])
+    opcodes_name.append(f"\"{data[0]}\"")
+    opcodes_argtype.append("{" + ", ".join(str(t) for t in argtypes) + "}")
+
     # Generate compile file
-    if int(data[2]) > 0:
-        compile.write(f"case {data[1]}: {{\n"
-                      f"\tfor (size_t i = 0; i < {data[2]}; i++) {{\n"
-                      f"\t\t++pc;\n")
-        if int(data[3]) == 0:
-            compile.write(f"\t\tcompiled_text[pc] = strtol(text[pc].ptr, NULL, 10);\n"
-                           "\t}\n")
-        elif int(data[3]) == 1:
-            compile.write(f"\t\tcompiled_text[pc] = strtol(text[pc].ptr + 1, NULL, 10);\n"
-                           "\t}\n")
-        elif int(data[3]) == 2:
-            compile.write(f"\t\ttmp.ptr = text[pc].ptr;\n\t\ttmp.len = text[pc].len;\n\t\tcompiled_text[pc] = label_trie.get_code(tmp);\n\t}}\n")
+    if argc > 0:
+        compile.write(f"case {data[1]}: {{\n")
+        for t in argtypes:
+            compile.write(f"\t++pc;\n"
+                          f"\tcompiled_text[pc] = {ARG_READERS[t]};\n")
         compile.write("\tbreak;\n"
                       "}\n")
     
-    # Generate trie initialisation
-    command_size = len(data[0])
-    create_trie.write(f"command_trie.insert({{ \"{data[0]}\", {command_size} }}, {data[1]});\n")
+    mnemonic_codes[data[0]] = data[1]
 
     # Generate disassembly
     disassembly.write(f"case {data[1]}: {{\n"
                       f"\tfprintf(intial, \"{data[0]}\");\n")
-    if int(data[2]) > 0:
-        disassembly.write(f"\tfor (size_t i = 0; i < {data[2]}; i++) {{\n"
-                          f"\t\t++pc;\n")
-        if int(data[3]) == 0:
-            disassembly.write(f"\t\tfprintf(intial, \" %d\", compiled_text[pc]);\n")
-        elif int(data[3]) == 1:
-            disassembly.write(f"\t\tfprintf(intial, \" r%d\", compiled_text[pc]);\n")
-        elif int(data[3]) == 2:
-            disassembly.write(f"\t\tfprintf(intial, \" label%d\", compiled_text[compiled_text[pc]] & 0b1111);\n")
-
-        disassembly.write("\t}\n")
+    for t in argtypes:
+        disassembly.write(f"\t++pc;\n"
+                          f"\tfprintf(intial, {ARG_FORMATS[t]});\n")
     disassembly.write(f"\tfprintf(intial, \"\\n\");\n"
              f"\tbreak;\n}}\n")
 
     # Generate listing file
     fill_spaces = 30
-    fill_string = (fill_spaces - 11 * int(data[2])) * ' '
+    fill_string = (fill_spaces - 11 * argc) * ' '
     listing.write(f"case {data[1]}: {{\n"
                   f"\tfprintf(listing, \"%#010x\", {data[1]});\n")
-    if int(data[2]) > 0:
+    if argc > 0:
         listing.write(f"\tfor (size_t i = 0; i < {data[2]}; i++) {{\n"
                       f"\t\t++pc1;\n"
                       f"\t\tfprintf(listing, \" %#010x\", compiled_text[pc1]);\n"
@@ -82,20 +97,91 @@ for line in commands:
     listing.write(f"\tfprintf(listing, \"{fill_string}\");\n")
     listing.write(f"\tfprintf(listing, \";\");\n")
     listing.write(f"\tfprintf(listing, \"{data[0]}\");\n")
-    if int(data[2]) > 0:
+    if argc > 0:
         listing.write(f"\tfor (size_t i = 0; i < {data[2]}; i++) {{\n"
                       f"\t\t++pc2;\n"
-                      f"\t\tfprintf(listing, \" %s\", text[pc2].ptr);\n"
+                      f"\t\tfprintf(listing, \" %.*s\", word(pc2).len, word(pc2).ptr);\n"
                       f"\t}}\n")
     listing.write(f"\tfprintf(listing, \"\\n\");\n"
                       f"\tbreak;\n}}\n")
 
 
+assert LABEL_CODE >= len(opcodes_argc)
+opcodes.write("};\n\n"
+              "// Cell of a label definition ($name) in the code, it is not a command and is stepped over.\n"
+              f"constexpr int LABEL_CODE = {LABEL_CODE};\n\n"
+              f"constexpr int OPCODE_ARGC[] = {{ {', '.join(opcodes_argc)} }};\n\n"
+              f"constexpr int OPCODE_MAX_ARGC = {OPCODE_MAX_ARGC};\n\n"
+              "// Type of every argument: 0 - integer, 1 - register, 2 - label.\n"
+              f"constexpr int OPCODE_ARGTYPE[][OPCODE_MAX_ARGC] = {{ {', '.join(opcodes_argtype)} }};\n\n"
+              f"constexpr const char *OPCODE_NAME[] = {{ {', '.join(opcodes_name)} }};\n")
+
+
+# Generate perfect hash of mnemonics: FNV-1a with a seed picked so that no two mnemonics share a slot.
+# The slot is taken from the top bits, the low bits of FNV depend only on the low bits of the seed.
+def fnv(word, seed):
+    h = seed
+    for c in word.encode():
+        h = ((h ^ c) * 16777619) & 0xffffffff
+    return h
+
+
+MNEMONIC_MAX_LEN = 8
+table_bits = 1
+while (1 << table_bits) < 2 * len(mnemonic_codes):
+    table_bits += 1
+table_size = 1 << table_bits
+seed = 2166136261
+while len({fnv(word, seed) >> (32 - table_bits) for word in mnemonic_codes}) != len(mnemonic_codes):
+    seed += 1
+table = [("", 0, -1)] * table_size
+for word, code in mnemonic_codes.items():
+    # name keeps the terminating zero of the string literal
+    assert len(word) < MNEMONIC_MAX_LEN, f"{word} is longer than {MNEMONIC_MAX_LEN - 1} characters"
+    table[fnv(word, seed) >> (32 - table_bits)] = (word, len(word), code)
+
+mnemonics.write("#pragma once\n\n"
+                "#include <cstdint>\n"
+                "#include <cstring>\n\n"
+                "struct Mnemonic {\n"
+                f"    char name[{MNEMONIC_MAX_LEN}];\n"
+                "    int  len;\n"
+                "    int  code;\n"
+                "};\n\n"
+                f"constexpr uint32_t MNEMONIC_SEED = {seed}u;\n"
+                f"constexpr uint32_t MNEMONIC_SHIFT = {32 - table_bits};\n\n"
+                f"constexpr Mnemonic MNEMONICS[{table_size}] = {{\n")
+for word, size, code in table:
+    mnemonics.write(f"    {{\"{word}\", {size}, {code}}},\n")
+mnemonics.write("};\n\n"
+                "//! \\return Opcode of the mnemonic or -1.\n"
+                "inline int mnemonic_code(const char *ptr, int len) {\n"
+                f"    if (len > {MNEMONIC_MAX_LEN}) return -1;\n"
+                "    uint32_t h = MNEMONIC_SEED;\n"
+                "    for (int i = 0; i < len; ++i) {\n"
+                "        h = (h ^ uint8_t(ptr[i])) * 16777619u;\n"
+                "    }\n"
+                "    const Mnemonic &entry = MNEMONICS[h >> MNEMONIC_SHIFT];\n"
+                "    return entry.len == len && !memcmp(entry.name, ptr, len) ? entry.code : -1;\n"
+                "}\n")
+
+# Generate toolchain version: objects depend on the command set and on the generated code.
+# The object cache keys on the compile executable itself, this digest is its fallback without /proc.
+version = generate_file(VERSION_PATH)
+digest = hashlib.sha1()
+for path in [COMMANDS_PATH, __file__]:
+    with open(path, 'rb') as source:
+        digest.update(source.read())
+version.write("#pragma once\n\n"
+              f"constexpr const char TOOLCHAIN_VERSION[] = \"{digest.hexdigest()}\";\n")
+version.close()
+
 execute.close()
 compile.close()
 commands.close()
-create_trie.close()
+mnemonics.close()
 disassembly.close()
 listing.close()
+opcodes.close()
     
 
@@ -0,0 +1,108 @@
+#include "label_table.h"
+
+LabelTable::LabelTable(size_t capacity, bool copy_names)
+        : entries(capacity, Entry{nullptr, 0, 0, -1, -1}), used(0), copy_names(copy_names), block_free(nullptr), block_left(0) {}
+
+uint32_t LabelTable::hash(const string_view &name) {
+    uint32_t result = 2166136261u;
+    for (int i = 0; i < name.len; ++i) {
+        result = (result ^ uint8_t(name.ptr[i])) * 16777619u;
+    }
+    return result;
+}
+
+// Slot of the label or the empty slot where it belongs.
+size_t LabelTable::probe(const string_view &name, uint32_t h) const {
+    size_t mask = entries.size() - 1;
+    size_t i = h & mask;
+    while (entries[i].ptr &&
+           !(entries[i].hash == h && entries[i].len == name.len && !memcmp(entries[i].ptr, name.ptr, name.len))) {
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+LabelTable::Entry &LabelTable::insert(const string_view &name) {
+    if ((used + 1) * 4 > entries.size() * 3) {
+        grow();
+    }
+    uint32_t h = hash(name);
+    Entry &entry = entries[probe(name, h)];
+    if (!entry.ptr) {
+        entry = Entry{copy_names ? store(name) : name.ptr, name.len, h, -1, -1};
+        ++used;
+    }
+    return entry;
+}
+
+// Names are packed into blocks that never move, so entries keep pointing at them.
+const char *LabelTable::store(const string_view &name) {
+    const size_t BLOCK_SIZE = 1 << 16;
+    if (size_t(name.len) > block_left) {
+        block_left = std::max(BLOCK_SIZE, size_t(name.len));
+        name_blocks.emplace_back(new char[block_left]);
+        block_free = name_blocks.back().get();
+    }
+    char *copy = block_free;
+    memcpy(copy, name.ptr, name.len);
+    block_free += name.len;
+    block_left -= name.len;
+    return copy;
+}
+
+void LabelTable::grow() {
+    std::vector<Entry> old(entries.size() * 2, Entry{nullptr, 0, 0, -1, -1});
+    old.swap(entries);
+    size_t mask = entries.size() - 1;
+    for (auto &entry : old) {
+        if (!entry.ptr) {
+            continue;
+        }
+        size_t i = entry.hash & mask;
+        while (entries[i].ptr) {
+            i = (i + 1) & mask;
+        }
+        entries[i] = entry;
+    }
+}
+
+bool LabelTable::define(const string_view &name, int pc) {
+    Entry &entry = insert(name);
+    if (entry.pc != -1) {
+        return false;
+    }
+    entry.pc = pc;
+    return true;
+}
+
+int LabelTable::reference(const string_view &name, int pc) {
+    Entry &entry = insert(name);
+    if (entry.pc != -1) {
+        return entry.pc;
+    }
+    int previous = entry.chain;
+    entry.chain = pc;
+    return previous;
+}
+
+int LabelTable::patch(int *code) {
+    int undefined = 0;
+    for (auto &entry : entries) {
+        if (!entry.ptr || entry.chain == -1) {
+            continue;
+        }
+        undefined += entry.pc == -1;
+        for (int pc = entry.chain; pc != -1;) {
+            int next = code[pc];
+            code[pc] = entry.pc;
+            pc = next;
+        }
+        entry.chain = -1;
+    }
+    return undefined;
+}
+
+int LabelTable::find(const string_view &name) const {
+    const Entry &entry = entries[probe(name, hash(name))];
+    return entry.ptr ? entry.pc : -1;
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include "text_proc.h"
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+//! \brief Open addressing table of labels keyed by string_view into the source text.
+//! \details References to labels that are not defined yet are chained through the output code itself:
+//!          the referencing cell keeps pc of the previous reference to the same label (-1 ends the chain).
+//!          patch() walks the chains once the whole text is assembled.
+//!          With copy_names the table keeps its own copies of the names, so the text may be released.
+class LabelTable {
+public:
+    explicit LabelTable(size_t capacity = 1024, bool copy_names = false);
+
+    //! \return false if the label is already defined, the first definition stays.
+    bool define(const string_view &name, int pc);
+
+    //! \return Value to store in the cell at pc that references the label.
+    int reference(const string_view &name, int pc);
+
+    //! \brief Fills every chained reference, undefined labels get -1.
+    //! \return Number of undefined labels.
+    int patch(int *code);
+
+    //! \return pc of the label or -1.
+    int find(const string_view &name) const;
+
+private:
+    struct Entry {
+        const char *ptr;
+        int         len;
+        uint32_t    hash;
+        int         pc;     // -1 until the label is defined
+        int         chain;  // last pending reference or -1
+    };
+
+    std::vector<Entry> entries;
+    size_t used;
+    bool copy_names;
+    std::vector<std::unique_ptr<char[]>> name_blocks;
+    char *block_free;
+    size_t block_left;
+
+    static uint32_t hash(const string_view &name);
+    size_t probe(const string_view &name, uint32_t h) const;
+    Entry &insert(const string_view &name);
+    const char *store(const string_view &name);
+    void grow();
+};
@@ -0,0 +1,208 @@
+#include <unistd.h>
+#include <string_view>
+#include <vector>
+
+#include "text_proc.h"
+#include "label_table.h"
+#include "cfg.h"
+
+//! \brief Object file produced by compile -c, names point into its mapped text.
+struct Object {
+    const char *text;
+    long long size;
+    span *words;
+    long long code_size;
+    std::vector<std::pair<string_view, int>> exports;
+    std::vector<std::pair<string_view, int>> imports;
+    std::vector<int> relocations;
+    std::vector<std::pair<string_view, int>> symbols;
+    std::vector<std::pair<string_view, std::vector<int>>> lines;  // file and its pairs of pc and line
+    bool cfg;
+};
+
+//! \brief Places objects one after another, moves their relocations and resolves imports by exports.
+class Linker {
+public:
+    ~Linker() {
+        for (auto &object : objects) {
+            unmap_input(object.text, object.size);
+            free(object.words);
+        }
+    }
+
+    void add(const char *INPUT_FILE);
+
+    //! \brief The object exporting main goes first, so the image starts with its jmp main.
+    //! \return Number of imports that are undefined or defined by several objects, the image is written if none;
+    //!         1 if the output can't be opened.
+    int link(const char *OUTPUT_FILE);
+
+private:
+    std::vector<Object> objects;
+
+    //! \brief .symbols and .lines of the objects that have them, moved to their place in the image.
+    void write_debug_info(FILE *linked, const std::vector<long long> &base);
+};
+
+//! \details Sections other than .exports, .imports, .relocations, .symbols and .lines are skipped,
+//!          .cfg is built anew for the whole image.
+void Linker::add(const char *INPUT_FILE) {
+    Object object = {};
+    object.size = map_input(INPUT_FILE, object.text);
+    long long words_number = tokenize(object.text, object.size, object.words);
+    object.code_size = code_size(object.text, object.words, words_number);
+    auto word = [&](long long i) { return string_view(object.text + object.words[i].offset, object.words[i].len); };
+    auto number = [&](long long i) { return parse_int(word(i).ptr, word(i).len); };
+    // Files of .lines are quoted, so they are told from its pcs and lines by the first character.
+    auto is_file = [](string_view w) { return w.ptr[0] == '"'; };
+
+    string_view section;
+    for (long long i = object.code_size; i < words_number; ++i) {
+        string_view current = word(i);
+        if (current.ptr[0] == '.') {
+            section = current;
+            object.cfg |= std::string_view(section.ptr, section.len) == ".cfg";
+            continue;
+        }
+        std::string_view name(section.ptr, section.len);
+        if (name == ".exports" && i + 1 < words_number) {
+            object.exports.emplace_back(current, number(++i));
+        } else if (name == ".imports" && i + 1 < words_number) {
+            object.imports.emplace_back(current, number(++i));
+        } else if (name == ".relocations") {
+            object.relocations.push_back(number(i));
+        } else if (name == ".symbols" && i + 1 < words_number) {
+            object.symbols.emplace_back(current, number(++i));
+        } else if (name == ".lines" && is_file(current)) {
+            object.lines.emplace_back(current, std::vector<int>());
+        } else if (name == ".lines" && !object.lines.empty()) {
+            object.lines.back().second.push_back(number(i));
+        }
+    }
+    objects.push_back(object);
+}
+
+int Linker::link(const char *OUTPUT_FILE) {
+    for (size_t i = 0; i < objects.size(); ++i) {
+        bool has_main = false;
+        for (auto &[name, pc] : objects[i].exports) {
+            has_main |= std::string_view(name.ptr, name.len) == "main";
+        }
+        if (has_main) {
+            std::rotate(objects.begin(), objects.begin() + i, objects.begin() + i + 1);
+            break;
+        }
+    }
+
+    // Labels like while0 repeat in every object, they only matter if someone imports them.
+    LabelTable symbols;
+    LabelTable duplicates;
+    std::vector<long long> base(objects.size());
+    long long total = 0;
+    for (size_t i = 0; i < objects.size(); ++i) {
+        base[i] = total;
+        total += objects[i].code_size;
+        for (auto &[name, pc] : objects[i].exports) {
+            if (!symbols.define(name, base[i] + pc)) {
+                duplicates.define(name, 0);
+            }
+        }
+    }
+
+    std::vector<int> image(total);
+    LabelTable reported;
+    int errors = 0;
+    for (size_t i = 0; i < objects.size(); ++i) {
+        Object &object = objects[i];
+        int *code = image.data() + base[i];
+        for (long long pc = 0; pc < object.code_size; ++pc) {
+            code[pc] = parse_int(object.text + object.words[pc].offset, object.words[pc].len);
+        }
+        for (int pc : object.relocations) {
+            code[pc] += base[i];
+        }
+        for (auto &[name, pc] : object.imports) {
+            code[pc] = symbols.find(name);
+            if (duplicates.find(name) != -1 || code[pc] == -1) {
+                ++errors;
+                if (reported.define(name, 0)) {
+                    fprintf(stderr, code[pc] == -1 ? "Undefined symbol %.*s\n" : "Symbol %.*s is defined more than once\n",
+                            name.len, name.ptr);
+                }
+            }
+        }
+    }
+    if (errors) {
+        return errors;
+    }
+
+    auto linked = fopen(OUTPUT_FILE, "w");
+    if (!linked) {
+        fprintf(stderr, "Can't open %s\n", OUTPUT_FILE);
+        return 1;
+    }
+    for (int cell : image) {
+        fprintf(linked, "%d ", cell);
+    }
+    write_debug_info(linked, base);
+    if (std::any_of(objects.begin(), objects.end(), [](const Object &object) { return object.cfg; })) {
+        write_cfg(linked, build_cfg(image.data(), total));
+        fprintf(linked, "\n");
+    }
+    fclose(linked);
+    return 0;
+}
+
+void Linker::write_debug_info(FILE *linked, const std::vector<long long> &base) {
+    bool symbols = false;
+    bool lines = false;
+    for (auto &object : objects) {
+        symbols |= !object.symbols.empty();
+        lines |= !object.lines.empty();
+    }
+    if (symbols) {
+        fprintf(linked, "\n.symbols");
+        for (size_t i = 0; i < objects.size(); ++i) {
+            for (auto &[name, pc] : objects[i].symbols) {
+                fprintf(linked, " %.*s %lld", name.len, name.ptr, base[i] + pc);
+            }
+        }
+    }
+    if (lines) {
+        fprintf(linked, "\n.lines");
+        for (size_t i = 0; i < objects.size(); ++i) {
+            for (auto &[file, pairs] : objects[i].lines) {
+                fprintf(linked, " %.*s", file.len, file.ptr);
+                for (size_t j = 0; j + 1 < pairs.size(); j += 2) {
+                    fprintf(linked, " %lld %d", base[i] + pairs[j], pairs[j + 1]);
+                }
+            }
+        }
+    }
+    if (symbols || lines) {
+        fprintf(linked, "\n");
+    }
+}
+
+
+int main(int argc, char **argv) {
+    Linker linker;
+    char default_output[] = "a.txt";
+    char *output_filename = default_output;
+    int key = 0;
+    while ((key = getopt(argc, argv, ":o:")) != -1) {
+        switch (key) {
+            case 'o':
+                output_filename = optarg;
+                break;
+        }
+    }
+    if (optind == argc) {
+        fprintf(stderr, "No objects to link\n");
+        return 1;
+    }
+    for (int i = optind; i < argc; ++i) {
+        linker.add(argv[i]);
+    }
+    return linker.link(output_filename) ? 1 : 0;
+}
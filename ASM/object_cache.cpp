@@ -0,0 +1,202 @@
+#include "object_cache.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+static inline uint64_t rotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t avalanche(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+static CacheKey hash128(const char *text, size_t size, uint64_t seed) {
+    const uint64_t C1 = 0x87c37b91114253d5ULL;
+    const uint64_t C2 = 0x4cf5ad432745937fULL;
+    uint64_t h1 = seed;
+    uint64_t h2 = seed;
+    auto round = [&](const char *block, bool last) {
+        uint64_t k1, k2;
+        memcpy(&k1, block, sizeof(k1));
+        memcpy(&k2, block + sizeof(k1), sizeof(k2));
+        h1 ^= rotl(k1 * C1, 31) * C2;
+        h2 ^= rotl(k2 * C2, 33) * C1;
+        if (!last) {
+            h1 = (rotl(h1, 27) + h2) * 5 + 0x52dce729;
+            h2 = (rotl(h2, 31) + h1) * 5 + 0x38495ab5;
+        }
+    };
+    size_t blocks = size / 16;
+    for (size_t i = 0; i < blocks; ++i) {
+        round(text + 16 * i, false);
+    }
+    char tail[16] = {};
+    if (size % 16) {
+        memcpy(tail, text + 16 * blocks, size % 16);
+    }
+    round(tail, true);
+
+    h1 ^= size;
+    h2 ^= size;
+    h1 += h2;
+    h2 += h1;
+    h1 = avalanche(h1);
+    h2 = avalanche(h2);
+    h1 += h2;
+    h2 += h1;
+    return {h1, h2};
+}
+
+std::string CacheKey::hex() const {
+    char result[33];
+    snprintf(result, sizeof(result), "%016llx%016llx", (unsigned long long) high, (unsigned long long) low);
+    return result;
+}
+
+CacheKey cache_key(const char *text, long long size, const std::string &salt) {
+    return hash128(text, size, hash128(salt.data(), salt.size(), 0).low);
+}
+
+bool executable_key(CacheKey &key) {
+    int input = open("/proc/self/exe", O_RDONLY);
+    if (input < 0) {
+        return false;
+    }
+    struct stat info = {};
+    void *text = fstat(input, &info) || info.st_size == 0
+                 ? MAP_FAILED : mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, input, 0);
+    close(input);
+    if (text == MAP_FAILED) {
+        return false;
+    }
+    key = hash128((const char *) text, info.st_size, 0);
+    munmap(text, info.st_size);
+    return true;
+}
+
+static bool copy_file(const char *from, const char *to) {
+    int input = open(from, O_RDONLY);
+    if (input < 0) {
+        return false;
+    }
+    int output = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (output < 0) {
+        close(input);
+        return false;
+    }
+    char buffer[1 << 16];
+    ssize_t got = 0;
+    bool ok = true;
+    while (ok && (got = read(input, buffer, sizeof(buffer))) > 0) {
+        ok = write(output, buffer, got) == got;
+    }
+    close(input);
+    close(output);
+    return ok && got == 0;
+}
+
+ObjectCache::ObjectCache() : capacity(256LL << 20) {
+    if (const char *dir = getenv("ASM_CACHE_DIR")) {
+        directory = dir;
+    } else if (const char *xdg = getenv("XDG_CACHE_HOME")) {
+        directory = std::string(xdg) + "/lang";
+    } else if (const char *home = getenv("HOME")) {
+        directory = std::string(home) + "/.cache/lang";
+    }
+    if (const char *size = getenv("ASM_CACHE_SIZE")) {
+        capacity = atoll(size) << 20;
+    }
+}
+
+std::string ObjectCache::path(const CacheKey &key) const {
+    return directory + "/" + key.hex() + ".obj";
+}
+
+bool ObjectCache::fetch(const CacheKey &key, const char *OUTPUT_FILE) {
+    std::string entry = path(key);
+    if (!copy_file(entry.c_str(), OUTPUT_FILE)) {
+        return false;
+    }
+    utimensat(AT_FDCWD, entry.c_str(), nullptr, 0);
+    return true;
+}
+
+void ObjectCache::store(const CacheKey &key, const char *OUTPUT_FILE) {
+    for (size_t slash = directory.find('/', 1); ; slash = directory.find('/', slash + 1)) {
+        mkdir(directory.substr(0, slash).c_str(), 0755);
+        if (slash == std::string::npos) {
+            break;
+        }
+    }
+    std::string temporary = directory + "/tmp." + std::to_string(getpid()) + "." + key.hex();
+    if (copy_file(OUTPUT_FILE, temporary.c_str())) {
+        rename(temporary.c_str(), path(key).c_str());
+    } else {
+        unlink(temporary.c_str());
+    }
+    evict();
+}
+
+void ObjectCache::evict() {
+    struct Entry {
+        std::string path;
+        long long size;
+        timespec used;
+    };
+    std::vector<Entry> entries;
+    long long total = 0;
+    DIR *dir = opendir(directory.c_str());
+    if (!dir) {
+        return;
+    }
+    // A store that died before its rename leaves its temporary file, such files are removed once they are
+    // old enough not to belong to a store still running.
+    const time_t STALE_SECONDS = 600;
+    time_t now = time(nullptr);
+    while (dirent *file = readdir(dir)) {
+        std::string name = file->d_name;
+        struct stat info = {};
+        if (stat((directory + "/" + name).c_str(), &info)) {
+            continue;
+        }
+        if (!name.compare(0, 4, "tmp.") && now - info.st_mtim.tv_sec > STALE_SECONDS) {
+            unlink((directory + "/" + name).c_str());
+            continue;
+        }
+        if (name.size() < 4 || name.compare(name.size() - 4, 4, ".obj")) {
+            continue;
+        }
+        entries.push_back({directory + "/" + name, info.st_size, info.st_mtim});
+        total += info.st_size;
+    }
+    closedir(dir);
+    if (total <= capacity) {
+        return;
+    }
+    std::sort(entries.begin(), entries.end(), [](const Entry &left, const Entry &right) {
+        return left.used.tv_sec != right.used.tv_sec ? left.used.tv_sec < right.used.tv_sec
+                                                     : left.used.tv_nsec < right.used.tv_nsec;
+    });
+    for (auto &entry : entries) {
+        if (total <= capacity) {
+            break;
+        }
+        unlink(entry.path.c_str());
+        total -= entry.size;
+    }
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+//! \brief 128-bit key of an assembler input.
+struct CacheKey {
+    uint64_t low;
+    uint64_t high;
+
+    std::string hex() const;
+};
+
+//! \brief Hash of the text seeded by salt (toolchain version and options that change the output).
+//! \details Murmur3-like, 16 bytes per step. It tells inputs apart, it is not meant to resist collisions on purpose.
+CacheKey cache_key(const char *text, long long size, const std::string &salt);
+
+//! \brief Hash of the running executable, so a rebuilt assembler never gets objects of the old one.
+//! \return false if /proc/self/exe can't be read.
+bool executable_key(CacheKey &key);
+
+//! \brief Directory of objects named by the key of their input.
+//! \details Entries are written to a temporary file and renamed, so builds sharing the directory never see
+//!          a partial one. A hit touches the entry, and after a store the least recently touched entries are
+//!          removed until the directory fits the size cap, along with temporary files left by dead stores.
+class ObjectCache {
+public:
+    //! \details Directory is ASM_CACHE_DIR, else $XDG_CACHE_HOME/lang, else ~/.cache/lang.
+    //!          The cap is ASM_CACHE_SIZE megabytes (256 by default), 0 disables the cache.
+    ObjectCache();
+
+    bool enabled() const { return !directory.empty() && capacity > 0; }
+
+    //! \return true if the cached object was copied to OUTPUT_FILE.
+    bool fetch(const CacheKey &key, const char *OUTPUT_FILE);
+
+    //! \brief Puts a copy of OUTPUT_FILE into the cache.
+    void store(const CacheKey &key, const char *OUTPUT_FILE);
+
+private:
+    std::string directory;
+    long long capacity;
+
+    std::string path(const CacheKey &key) const;
+    void evict();
+};
@@ -5,14 +5,20 @@
 #include <cstring>
 #include <cinttypes>
 #include <unistd.h>
+#include <vector>
 
-#include "trie.h"
 #include "SafeStackDynamicOnePlace.hpp"
+#include "SharedStack.hpp"
 #include "text_proc.h"
+#include "../BinaryTranslator/RealASMTranslator.hpp"
 
+// Functions start interpreted. Once calls to a function plus backward jumps inside it reach the threshold,
+// it is translated and later calls run natively on the same registers and operand stack (NativeState).
 class Processor {
 public:
-    Processor();
+    explicit Processor(int threshold);
+
+    ~Processor() { delete translator; }
 
     void write_output() {
         for (int i = 0; i < size; ++i) {
@@ -22,7 +28,25 @@ public:
 
     void execute(char *file_name);
 
+    void profile(const char *source_name, bool jitdump);
+
 private:
+    void run();
+
+    void invoke(int target);
+
+    bool enter_native(int target);
+
+    void count(int target);
+
+    static void native_call(NativeState *state, int target);
+
+    static void native_in(NativeState *state);
+
+    static void native_out(NativeState *state);
+
+    static void native_end(NativeState *state);
+
     inline void pushr();
 
     inline void popr();
@@ -75,39 +99,58 @@ private:
 
     inline void cmptop();
 
+    inline void movi();
+
+    inline void mov();
+
+    inline void addi();
+
     int pc;
-    uint8_t flag;
     int *compiled_text;
     int size;
-    Stack<int, 8> stack;
-    Stack<int, 8> call_stack;
     int r[1001];
-    int cmp_num1, cmp_num2;
-    const uint8_t SF = 0b00000010;
-    const uint8_t ZF = 0b00000001;
+    // Flags are kept as the result of the last comparison, native code reads them the same way.
+    NativeState state;
+    SharedStack<int> stack;
+    Stack<int, 8> call_stack;
+    // Entry of every active function, backward jumps are counted for the top one.
+    std::vector<int> frames;
+    std::vector<int> hotness;
+    std::vector<NativeFunction> native;
+    std::vector<bool> untranslatable;
+    RealASMTranslator *translator;
+    int threshold;
+    const char *profile_source;
+    bool profile_jitdump;
+    bool profile_enabled;
+    // Return address of an interpreted function called from native code.
+    static constexpr int NATIVE_FRAME = -2;
+    static constexpr size_t STACK_CAPACITY = 1 << 20;
 };
 
-Processor::Processor() : compiled_text(nullptr), size(0), stack(get_var_name(stack)),
-                         call_stack(get_var_name(call_stack)), pc(0), flag(0) {}
+Processor::Processor(int threshold) : compiled_text(nullptr), size(0), r(),
+                                      state{r, nullptr, 0, this, native_call, native_in, native_out, native_end},
+                                      stack(state.sp, STACK_CAPACITY), call_stack(get_var_name(call_stack)), pc(0),
+                                      translator(nullptr), threshold(threshold), profile_source(nullptr),
+                                      profile_jitdump(false), profile_enabled(false) {}
+
+// Native functions show up in perf under their labels. A label's pc is its word index in the ASM source.
+void Processor::profile(const char *source_name, bool jitdump) {
+    profile_source = source_name;
+    profile_jitdump = jitdump;
+    profile_enabled = true;
+}
 
 inline void Processor::cmp() {
-    flag = 0;
     int arg1 = r[compiled_text[++pc]];
-    int result = arg1 - r[compiled_text[++pc]];
-
-    if (result < 0) flag |= SF;
-    if (result == 0) flag |= ZF;
+    state.cmp = arg1 - r[compiled_text[++pc]];
 }
 
 inline void Processor::cmptop() {
-    flag = 0;
     int arg1 = stack.top();
     stack.pop();
-    int result = stack.top() - arg1;
+    state.cmp = stack.top() - arg1;
     stack.pop();
-
-    if (result < 0) flag |= SF;
-    if (result == 0) flag |= ZF;
 }
 
 inline void Processor::pushr() {
@@ -127,8 +170,24 @@ inline void Processor::popr() {
     stack.pop();
 }
 
+inline void Processor::movi() {
+    int reg = compiled_text[++pc];
+    r[reg] = compiled_text[++pc];
+}
+
+inline void Processor::mov() {
+    int to = compiled_text[++pc];
+    r[to] = r[compiled_text[++pc]];
+}
+
+inline void Processor::addi() {
+    int reg = compiled_text[++pc];
+    r[reg] += compiled_text[++pc];
+}
+
 inline void Processor::jmp() {
     int pos = compiled_text[++pc];
+    if (pos < pc && !frames.empty()) count(frames.back());
     pc = pos;
 }
 
@@ -170,14 +229,20 @@ inline void Processor::out() {
 }
 
 inline void Processor::call() {
+    int pos = compiled_text[pc + 1];
+    if (enter_native(pos)) {
+        ++pc;
+        return;
+    }
     call_stack.push(pc + 1);
-    int pos = compiled_text[++pc];
+    frames.push_back(pos);
     pc = pos;
 }
 
 inline void Processor::ret() {
     pc = call_stack.top();
     call_stack.pop();
+    if (!frames.empty()) frames.pop_back();
 }
 
 inline void Processor::end() {
@@ -192,42 +257,48 @@ inline void Processor::in() {
 
 inline void Processor::je() {
     ++pc;
-    if (flag & ZF) {
+    if (state.cmp == 0) {
+        if (compiled_text[pc] < pc && !frames.empty()) count(frames.back());
         pc = compiled_text[pc];
     }
 }
 
 inline void Processor::jb() {
     ++pc;
-    if (flag & SF) {
+    if (state.cmp < 0) {
+        if (compiled_text[pc] < pc && !frames.empty()) count(frames.back());
         pc = compiled_text[pc];
     }
 }
 
 inline void Processor::ja() {
     ++pc;
-    if (!(flag & SF) & !(flag & ZF)) {
+    if (state.cmp > 0) {
+        if (compiled_text[pc] < pc && !frames.empty()) count(frames.back());
         pc = compiled_text[pc];
     }
 }
 
 inline void Processor::jbe() {
     ++pc;
-    if (flag & SF || flag & ZF) {
+    if (state.cmp <= 0) {
+        if (compiled_text[pc] < pc && !frames.empty()) count(frames.back());
         pc = compiled_text[pc];
     }
 }
 
 inline void Processor::jae() {
     ++pc;
-    if (!(flag & SF)) {
+    if (state.cmp >= 0) {
+        if (compiled_text[pc] < pc && !frames.empty()) count(frames.back());
         pc = compiled_text[pc];
     }
 }
 
 inline void Processor::jne() {
     ++pc;
-    if (!(flag & ZF)) {
+    if (state.cmp != 0) {
+        if (compiled_text[pc] < pc && !frames.empty()) count(frames.back());
         pc = compiled_text[pc];
     }
 }
@@ -261,27 +332,148 @@ inline void Processor::equal() {
 }
 
 void Processor::execute(char *file_name) {
-    char *initial_text = nullptr;
-    string_view *compiled_string_view = nullptr;
-    long long SIZE = read_input(file_name, initial_text);
-    long long text_size = separate_strings(initial_text, SIZE, compiled_string_view);
+    const char *initial_text = nullptr;
+    span *compiled_spans = nullptr;
+    long long SIZE = map_input(file_name, initial_text);
+    long long words_number = tokenize(initial_text, SIZE, compiled_spans);
+    long long text_size = code_size(initial_text, compiled_spans, words_number);
     compiled_text = (int *) calloc(text_size, sizeof(int));
     size = text_size;
     for (long long i = 0; i < size; ++i) {
-        compiled_text[i] = strtol(compiled_string_view[i].ptr, NULL, 10);
+        compiled_text[i] = parse_int(initial_text + compiled_spans[i].offset, compiled_spans[i].len);
     }
-    for (pc = 0; pc < size; ++pc) {
+    hotness.assign(size, 0);
+    native.assign(size, nullptr);
+    untranslatable.assign(size, false);
+    translator = new RealASMTranslator(compiled_text, size);
+    if (profile_enabled) {
+        std::map<int, std::string> names;
+        std::map<int, std::pair<std::string, int>> lines;
+        // Sections of compile -g, the code itself never looks at them.
+        auto word = [&](long long i) {
+            return std::string(initial_text + compiled_spans[i].offset, compiled_spans[i].len);
+        };
+        auto number = [&](long long i) { return parse_int(word(i).c_str(), compiled_spans[i].len); };
+        std::string section;
+        std::string file;
+        for (long long i = text_size; i < words_number; ++i) {
+            std::string current = word(i);
+            if (current[0] == '.') {
+                section = current;
+            } else if (section == ".symbols" && i + 1 < words_number) {
+                names[number(++i)] = current;
+            } else if (section == ".lines" && current[0] == '"') {
+                file = unquote(current.data(), current.size());
+            } else if (section == ".lines" && i + 1 < words_number) {
+                lines[number(i)] = {file, number(i + 1)};
+                ++i;
+            }
+        }
+        if (names.empty() && profile_source) {
+            const char *source = nullptr;
+            span *words = nullptr;
+            long long SOURCE_SIZE = map_input(profile_source, source);
+            long long source_words = tokenize(source, SOURCE_SIZE, words);
+            for (long long i = 0; i < source_words; ++i) {
+                if (source[words[i].offset] == '$') {
+                    names[i] = std::string(source + words[i].offset + 1, words[i].len - 1);
+                }
+            }
+            unmap_input(source, SOURCE_SIZE);
+            free(words);
+        }
+        translator->enable_profiling(names, lines, profile_jitdump);
+    }
+    unmap_input(initial_text, SIZE);
+    free(compiled_spans);
+    pc = 0;
+    run();
+}
+
+void Processor::run() {
+    for (; pc >= 0 && pc < size; ++pc) {
         int current_command = compiled_text[pc];
         switch (current_command) {
 #include "codegen/execute.cpp"
         }
     }
-    free(initial_text);
-    free(compiled_string_view);
+}
+
+// Runs the whole function, returns after its ret.
+void Processor::invoke(int target) {
+    if (enter_native(target)) {
+        return;
+    }
+    int caller_pc = pc;
+    call_stack.push(NATIVE_FRAME);
+    frames.push_back(target);
+    pc = target;
+    run();
+    pc = caller_pc;
+}
+
+bool Processor::enter_native(int target) {
+    if (target < 0 || target >= size) {
+        return false;
+    }
+    count(target);
+    if (!native[target]) {
+        return false;
+    }
+    native[target](&state);
+    return true;
+}
+
+void Processor::count(int target) {
+    if (threshold < 0 || native[target] || untranslatable[target] || ++hotness[target] < threshold) {
+        return;
+    }
+    native[target] = translator->translate(target);
+    untranslatable[target] = !native[target];
+}
+
+void Processor::native_call(NativeState *state, int target) {
+    ((Processor *) state->runtime)->invoke(target);
+}
+
+void Processor::native_in(NativeState *state) {
+    ((Processor *) state->runtime)->in();
+}
+
+void Processor::native_out(NativeState *state) {
+    ((Processor *) state->runtime)->out();
+}
+
+void Processor::native_end(NativeState *state) {
+    ((Processor *) state->runtime)->end();
 }
 
 int main(int argc, char **argv) {
-    Processor proc;
-    proc.execute(argv[1]);
+    int threshold = 1000;
+    const char *source_name = nullptr;
+    bool perf_map = false;
+    bool jitdump = false;
+    int key = 0;
+    while ((key = getopt(argc, argv, "t:s:pj")) != -1) {
+        switch (key) {
+            case 't':
+                threshold = strtol(optarg, NULL, 10);
+                break;
+            case 's':
+                source_name = optarg;
+                break;
+            case 'p':
+                perf_map = true;
+                break;
+            case 'j':
+                perf_map = jitdump = true;
+                break;
+        }
+    }
+    Processor proc(threshold);
+    if (perf_map) {
+        proc.profile(source_name, jitdump);
+    }
+    proc.execute(argv[optind]);
     return 0;
 }
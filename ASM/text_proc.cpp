@@ -1,120 +1,161 @@
 #include "text_proc.h"
 
 #include <iostream>
-
-long long get_file_size(FILE* file) {
-    assert(file);
-
-    fseek(file, 0, SEEK_END);
-    long long SIZE = ftell(file);
-    fseek(file, 0, SEEK_SET);
-    return SIZE;
-}
-
-//! \brief Функция считывает содержания файла и сохраняет его по данному указалетелю, возвращая размер файла.
+#include <emmintrin.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+//! \brief Функция отображает файл в память только для чтения.
+//! \details Текст не завершается \0, его границы задаются только размером.
 //! \param [in] file_name Имя исходного файла.
-//! \param [out] text_destination Указатель на память, выделенную под содержимое файла.
-//! \return Размер считанного файла.
-long long read_input(const char *file_name, char*& text_destination) {
+//! \param [out] text_destination Указатель на отображённое содержимое файла (nullptr для пустого файла).
+//! \return Размер файла.
+long long map_input(const char *file_name, const char*& text_destination) {
     assert(file_name);
 
-    FILE* input = fopen(file_name, "r"); assert(input);
-    long long SIZE = get_file_size(input);
+    int input = open(file_name, O_RDONLY); assert(input >= 0);
+    struct stat info = {};
+    fstat(input, &info);
+    long long SIZE = info.st_size;
 
-    text_destination = (char*)(calloc(SIZE, 1)); assert(text_destination);
-    fread(text_destination, 1, SIZE, input); assert(ferror(input) == 0);
+    text_destination = nullptr;
+    if (SIZE > 0) {
+        void *text = mmap(nullptr, SIZE, PROT_READ, MAP_PRIVATE, input, 0); assert(text != MAP_FAILED);
+        madvise(text, SIZE, MADV_SEQUENTIAL);
+        text_destination = (const char*)(text);
+    }
 
-    fclose(input);
+    close(input);
     return SIZE;
 }
 
-
-int separate_strings(char* text, long long SIZE, string_view*& string_array_destination) {
-    assert(text); assert(SIZE >= 0);
-    int line_number = 0;
-    for (long long i = 0; i < SIZE; ++i) {
-        if (text[i] == '\n' || text[i] == ' ') {
-            text[i] = '\0';
-            ++line_number;
-        }
+void unmap_input(const char *text, long long SIZE) {
+    if (text) {
+        munmap((void*)(text), SIZE);
     }
+}
 
-    string_array_destination = (string_view*)(calloc(line_number, sizeof(string_view)));
-
-    int text_ptr = 0;
-    for (int i = 0; i < line_number; ++i) {
-        string_array_destination[i].len = strlen(&text[text_ptr]);
-        string_array_destination[i].ptr = &text[text_ptr];
-        text_ptr += string_array_destination[i].len + 1;
+//! \details Бит i маски выставлен, если text[i] пробельный: ' ' или \t \n \v \f \r (0x09-0x0d).
+static inline uint64_t space_mask(const char* text) {
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i tab   = _mm_set1_epi8('\t');
+    const __m128i range = _mm_set1_epi8('\r' - '\t');
+    uint64_t mask = 0;
+    for (int i = 0; i < 4; ++i) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*)(text + 16 * i));
+        __m128i shifted = _mm_sub_epi8(chunk, tab);
+        __m128i is_control = _mm_cmpeq_epi8(_mm_min_epu8(shifted, range), shifted);
+        __m128i is_space = _mm_or_si128(_mm_cmpeq_epi8(chunk, space), is_control);
+        mask |= uint64_t(uint16_t(_mm_movemask_epi8(is_space))) << (16 * i);
     }
-    return line_number;
+    return mask;
 }
 
-//! \brief Функция разбивает текст на строки.
-//! \details Функция разбивает текст на строки, заменяя каждый \n в исходном тексте на \0.
+//! \brief Функция разбивает текст на слова за один проход, не изменяя его.
+//! \details Словом считается максимальная последовательность непробельных символов (в смысле isspace).
+//!          Для каждого блока из 64 байт строится маска пробелов, из неё маски начал и концов слов.
+//!          Начала и концы чередуются, поэтому начала дописываются в новые слова, а концы закрывают их по порядку.
 //! \param [in] text Указатель на исходный текст.
-//! \param [in] SIZE Размер исходного текста.
-//! \param [out] string_array_destination Указатель на память, в которую складываются строки.
-//! \return Количество строк.
-int separate_by_lines(char* text, long long SIZE, string_view*& string_array_destination) {
-    assert(text); assert(SIZE >= 0);
-    int line_number = 0;
-    for (long long i = 0; i < SIZE; ++i) {
-        if (text[i] == '\n') {
-            text[i] = '\0';
-            ++line_number;
+//! \param [in] SIZE Размер исходного текста, не больше 4 ГБ.
+//! \param [out] span_array_destination Указатель на память, в которую складываются слова.
+//! \return Количество слов.
+long long tokenize(const char* text, long long SIZE, span*& span_array_destination) {
+    assert(text || SIZE == 0); assert(SIZE >= 0); assert(SIZE <= UINT32_MAX);
+    const int BLOCK = 64;
+    long long capacity = SIZE / 8 + BLOCK;
+    span* spans = (span*)(malloc(capacity * sizeof(span))); assert(spans);
+    long long opened = 0;
+    long long closed = 0;
+    // Пробельность последнего байта предыдущего блока. Текст начинается как будто после пробела.
+    uint64_t carry = 1;
+    char tail[BLOCK];
+
+    for (long long base = 0; base < SIZE; base += BLOCK) {
+        const char* block = text + base;
+        if (SIZE - base < BLOCK) {
+            memset(tail, ' ', BLOCK);
+            memcpy(tail, block, SIZE - base);
+            block = tail;
+        }
+        if (opened + BLOCK / 2 > capacity) {
+            capacity *= 2;
+            spans = (span*)(realloc(spans, capacity * sizeof(span))); assert(spans);
+        }
+        uint64_t is_space = space_mask(block);
+        uint64_t after_space = (is_space << 1) | carry;
+        carry = is_space >> 63;
+        for (uint64_t starts = ~is_space & after_space; starts; starts &= starts - 1) {
+            spans[opened++].offset = base + __builtin_ctzll(starts);
+        }
+        for (uint64_t ends = is_space & ~after_space; ends; ends &= ends - 1) {
+            spans[closed].len = base + __builtin_ctzll(ends) - spans[closed].offset;
+            ++closed;
         }
     }
+    if (closed < opened) {
+        spans[closed].len = SIZE - spans[closed].offset;
+        ++closed;
+    }
 
-    string_array_destination = (string_view*)(calloc(line_number, sizeof(string_view)));
+    span_array_destination = spans;
+    return closed;
+}
 
-    int text_ptr = 0;
-    for (int i = 0; i < line_number; ++i) {
-        string_array_destination[i].len = strlen(&text[text_ptr]);
-        string_array_destination[i].ptr = &text[text_ptr];
-        text_ptr += string_array_destination[i].len + 1;
+//! \brief Функция переводит десятичное число со знаком, записанное в [ptr, ptr + len), как strtol.
+int parse_int(const char* ptr, int len) {
+    assert(ptr || len == 0);
+    int i = 0;
+    bool negative = false;
+    if (i < len && (ptr[i] == '-' || ptr[i] == '+')) {
+        negative = ptr[i] == '-';
+        ++i;
     }
-    return line_number;
+    long long value = 0;
+    for (; i < len && ptr[i] >= '0' && ptr[i] <= '9'; ++i) {
+        value = value * 10 + (ptr[i] - '0');
+    }
+    return int(negative ? -value : value);
 }
 
-int separate_by_words(char* text, long long SIZE, string_view*& string_array_destination) {
-    assert(text); assert(SIZE >= 0);
-    bool beginning = true;
-    int word_number = 0;
-    bool between_space = false;
-    for (long long i = 0; i < SIZE; ++i) {
-        while (beginning) {
-            if (isspace(text[i])) {
-                ++i;
-            } else {
-                beginning = false;
-            }
-        }
-        between_space = true;
-        if (text[i] == '\n') {
-            text[i] = '\0';
-            ++word_number;
-            between_space = false;
-            beginning = true;
-        }
-        if (isspace(text[i])) {
-            text[i] = '\0';
-            ++word_number;
+void write_quoted(FILE* output, const char* name) {
+    fputc('"', output);
+    for (; *name; ++name) {
+        unsigned char c = *name;
+        if (c <= ' ' || c >= 0x7f || c == '"' || c == '%') {
+            fprintf(output, "%%%02X", c);
+        } else {
+            fputc(c, output);
         }
     }
+    fputc('"', output);
+}
 
-    string_array_destination = (string_view*)(calloc(word_number, sizeof(string_view)));
-
-    int text_ptr = 0;
-    for (int i = 0; i < word_number; ++i) {
-        while (isspace(text[text_ptr])) {
-            ++text_ptr;
+std::string unquote(const char* ptr, int len) {
+    std::string name;
+    int end = len > 1 && ptr[len - 1] == '"' ? len - 1 : len;
+    for (int i = 1; i < end; ++i) {
+        if (ptr[i] == '%' && i + 2 < end && isxdigit(ptr[i + 1]) && isxdigit(ptr[i + 2])) {
+            char hex[3] = {ptr[i + 1], ptr[i + 2], '\0'};
+            name += char(strtol(hex, nullptr, 16));
+            i += 2;
+        } else {
+            name += ptr[i];
         }
-        string_array_destination[i].len = strlen(&text[text_ptr]);
-        string_array_destination[i].ptr = &text[text_ptr];
-        text_ptr += string_array_destination[i].len + 1;
     }
-    return word_number;
+    return name;
+}
+
+//! \brief Функция находит конец кода объектного файла.
+//! \details За кодом могут идти секции для компоновщика, каждая начинается со слова с точкой (.exports и т.д.).
+//! \return Количество слов кода.
+long long code_size(const char* text, const span* span_array, long long span_array_size) {
+    long long size = 0;
+    while (size < span_array_size && text[span_array[size].offset] != '.') {
+        ++size;
+    }
+    return size;
 }
 
 //! \brief Функция выводит в данный файл отсортированный в разном порядке массив строк.
@@ -6,15 +6,23 @@
 #include <cctype>
 #include <cassert>
 #include <cstdio>
+#include <cstdint>
+#include <string>
 
 
 struct string_view {
-    char* ptr;
-    int   len;
-    string_view(char* ptr, int len) : ptr(ptr), len(len) {}
+    const char* ptr;
+    int         len;
+    string_view(const char* ptr, int len) : ptr(ptr), len(len) {}
     string_view() : ptr(nullptr), len(0) {}
 };
 
+//! \details Слово текста: смещение от начала текста и длина. Сам текст не изменяется.
+struct span {
+    uint32_t offset;
+    uint32_t len;
+};
+
 //! \details Компаратор для строк. Сравнение с последнего символа.
 struct from_end {
     bool operator()(const string_view& left, const string_view& right) {
@@ -65,31 +73,41 @@ struct from_start {
 };
 
 
-long long get_file_size(FILE* file);
-
-//! \brief Функция считывает содержания файла и сохраняет его по данному указалетелю, возвращая размер файла.
+//! \brief Функция отображает файл в память только для чтения.
+//! \details Текст не завершается \0, его границы задаются только размером.
 //! \param [in] file_name Имя исходного файла.
-//! \param [out] text_destination Указатель на память, выделенную под содержимое файла.
-//! \return Размер считанного файла.
-long long read_input(const char *file_name, char*& text_destination);
+//! \param [out] text_destination Указатель на отображённое содержимое файла (nullptr для пустого файла).
+//! \return Размер файла.
+long long map_input(const char *file_name, const char*& text_destination);
 
-//! \brief Функция разбивает текст на строки.
-//! \details Функция разбивает текст на строки, заменяя каждый \n в исходном тексте на \0.
+//! \brief Функция освобождает память, полученную от map_input.
+void unmap_input(const char *text, long long SIZE);
+
+//! \brief Функция разбивает текст на слова за один проход, не изменяя его.
+//! \details Словом считается максимальная последовательность непробельных символов (в смысле isspace).
+//!          Границы слов ищутся блоками по 64 байта с помощью SSE2.
 //! \param [in] text Указатель на исходный текст.
-//! \param [in] SIZE Размер исходного текста.
-//! \param [out] string_array_destination Указатель на память, в которую складываются строки.
-//! \return Количество строк.
-int separate_by_lines(char* text, long long SIZE, string_view*& string_array_destination);
+//! \param [in] SIZE Размер исходного текста, не больше 4 ГБ.
+//! \param [out] span_array_destination Указатель на память, в которую складываются слова.
+//! \return Количество слов.
+long long tokenize(const char* text, long long SIZE, span*& span_array_destination);
 
-int separate_strings(char* text, long long SIZE, string_view*& string_array_destination);
+//! \brief Функция переводит десятичное число со знаком, записанное в [ptr, ptr + len), как strtol.
+int parse_int(const char* ptr, int len);
 
-//! \brief Функция разбивает текст на слова.
-//! \details Функция разбивает текст на слова, заменяя каждый \n в исходном тексте на \0 и игнорируя начальные пробелы.
-//! \param [in] text Указатель на исходный текст.
-//! \param [in] SIZE Размер исходного текста.
-//! \param [out] string_array_destination Указатель на память, в которую складываются слова.
-//! \return Количество строк.
-int separate_by_words(char* text, long long SIZE, string_view*& string_array_destination);
+//! \brief Функция выводит имя файла одним словом в кавычках.
+//! \details Пробельные и непечатаемые символы, кавычка и % записываются как %XX, так что имя не распадается
+//!          на слова и не путается с числом.
+void write_quoted(FILE* output, const char* name);
+
+//! \brief Функция восстанавливает имя, записанное write_quoted.
+//! \param [in] ptr Слово, начинающееся с кавычки.
+std::string unquote(const char* ptr, int len);
+
+//! \brief Функция находит конец кода объектного файла.
+//! \details За кодом могут идти секции для компоновщика, каждая начинается со слова с точкой (.exports и т.д.).
+//! \return Количество слов кода.
+long long code_size(const char* text, const span* span_array, long long span_array_size);
 //! \brief Функция выводит в данный файл отсортированный в разном порядке массив строк.
 //! \details Функция выводит в данный файл отсортированный в разном порядке массив строк. \
 //!          Сначала сортировка по первому символу, затем по последнему, а в конце исходный текст. \
@@ -0,0 +1,318 @@
+// Checks OP.hpp against the system assembler and measures encoder throughput.
+//
+//   encoder_test          encode the corpus, assemble the same text with `as` and compare with `objdump`
+//   encoder_test -b [N]   encode N instructions (10^6 by default) and report instructions per second
+//
+// Bytes are expected to match exactly. When they don't, both sequences are disassembled and compared as text,
+// as `as` sometimes picks a shorter equivalent (imm8 forms, B8+r MOV) the encoder does not implement.
+
+#include <sys/wait.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <vector>
+
+#include "OP.hpp"
+
+struct Case {
+  std::string text;
+  std::string bytes;
+};
+
+static const char* QWORD_NAMES[] = {"rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi",
+                                    "r8",  "r9",  "r10", "r11", "r12", "r13", "r14", "r15"};
+static const char* DWORD_NAMES[] = {"eax", "ecx", "edx", "ebx", "esp", "ebp", "esi", "edi",
+                                    "r8d", "r9d", "r10d", "r11d", "r12d", "r13d", "r14d", "r15d"};
+
+static std::string Name(int id, OperandSize size) { return size == QWORD ? QWORD_NAMES[id] : DWORD_NAMES[id]; }
+
+static std::string Xmm(int id) { return "xmm" + std::to_string(id); }
+
+static std::string Memory(const REG& op, const char* ptr) {
+  std::string result = std::string(ptr) + " PTR [" + QWORD_NAMES[op.GetId()];
+  if (op.HasIndex()) {
+    result += std::string("+") + QWORD_NAMES[op.GetIndex()] + "*" + std::to_string(op.GetScale());
+  }
+  if (op.GetOff() != 0) {
+    result += (op.GetOff() > 0 ? "+" : "") + std::to_string(op.GetOff());
+  }
+  return result + "]";
+}
+
+static const char* Ptr(OperandSize size) { return size == QWORD ? "QWORD" : "DWORD"; }
+
+// Memory operands covering every base, displacement width and SIB form.
+static std::vector<REG> MemoryOperands() {
+  std::vector<REG> result;
+  const int offsets[] = {0, 8, -4, 127, -128, 128, 4000, -100000};
+  for (int base = 0; base < 16; ++base) {
+    for (int off : offsets) {
+      result.emplace_back(base, off, true);
+    }
+    for (int index = 0; index < 16; ++index) {
+      if (index == RSP) {
+        continue;
+      }
+      for (int scale : {1, 2, 4, 8}) {
+        result.emplace_back(base, index, scale, (index + scale) % 3 == 0 ? 0 : 40 * index - 300);
+      }
+    }
+  }
+  return result;
+}
+
+static std::vector<Case> Corpus() {
+  std::vector<Case> corpus;
+  auto memory = MemoryOperands();
+  for (OperandSize size : {QWORD, DWORD}) {
+    for (int to = 0; to < 16; ++to) {
+      for (int from = 0; from < 16; ++from) {
+        std::string operands = " " + Name(to, size) + ", " + Name(from, size);
+        corpus.push_back({"mov" + operands, MOV(REG(to), REG(from), size).Get()});
+        corpus.push_back({"add" + operands, ADD(REG(to), REG(from), size).Get()});
+        corpus.push_back({"sub" + operands, SUB(REG(to), REG(from), size).Get()});
+        corpus.push_back({"cmp" + operands, CMP(REG(to), REG(from), size).Get()});
+        corpus.push_back({"test" + operands, TEST(REG(to), REG(from), size).Get()});
+      }
+    }
+    for (int reg = 0; reg < 16; reg += 5) {
+      for (auto& op : memory) {
+        std::string mem = Memory(op, Ptr(size));
+        corpus.push_back({"mov " + Name(reg, size) + ", " + mem, MOV(REG(reg), op, size).Get()});
+        corpus.push_back({"mov " + mem + ", " + Name(reg, size), MOV(op, REG(reg), size).Get()});
+        corpus.push_back({"add " + Name(reg, size) + ", " + mem, ADD(REG(reg), op, size).Get()});
+        corpus.push_back({"sub " + Name(reg, size) + ", " + mem, SUB(REG(reg), op, size).Get()});
+        corpus.push_back({"cmp " + Name(reg, size) + ", " + mem, CMP(REG(reg), op, size).Get()});
+      }
+    }
+    for (auto& op : memory) {
+      corpus.push_back({"mov " + Memory(op, Ptr(size)) + ", 100000", MOV(op, 100000, size).Get()});
+      corpus.push_back({"add " + Memory(op, Ptr(size)) + ", 100000", ADD(op, 100000, size).Get()});
+    }
+    for (int reg = 0; reg < 16; ++reg) {
+      corpus.push_back({"mov " + Name(reg, size) + ", -5", MOV(REG(reg), -5, size).Get()});
+    }
+  }
+  for (int reg = 0; reg < 16; ++reg) {
+    corpus.push_back({"add " + Name(reg, QWORD) + ", 70000", ADD(REG(reg), 70000).Get()});
+    corpus.push_back({"sub " + Name(reg, QWORD) + ", 70000", SUB(REG(reg), 70000).Get()});
+    corpus.push_back({"push " + Name(reg, QWORD), PUSH(REG(reg)).Get()});
+    corpus.push_back({"pop " + Name(reg, QWORD), POP(REG(reg)).Get()});
+    corpus.push_back({"idiv " + Name(reg, QWORD), IDIV(REG(reg)).Get()});
+    corpus.push_back({"call " + Name(reg, QWORD), CALL(REG(reg)).Get()});
+    for (int from = 0; from < 16; ++from) {
+      corpus.push_back({"imul " + Name(reg, QWORD) + ", " + Name(from, QWORD), IMUL(REG(reg), REG(from)).Get()});
+      corpus.push_back({"movsxd " + Name(reg, QWORD) + ", " + Name(from, DWORD), MOVSXD(REG(reg), REG(from)).Get()});
+    }
+  }
+  for (auto& op : memory) {
+    corpus.push_back({"push " + Memory(op, "QWORD"), PUSH(op).Get()});
+    corpus.push_back({"pop " + Memory(op, "QWORD"), POP(op).Get()});
+    corpus.push_back({"call " + Memory(op, "QWORD"), CALL(op).Get()});
+    corpus.push_back({"idiv " + Memory(op, "QWORD"), IDIV(op).Get()});
+    corpus.push_back({"imul rdx, " + Memory(op, "QWORD"), IMUL(REG(RDX), op).Get()});
+    corpus.push_back({"movsxd r9, " + Memory(op, "DWORD"), MOVSXD(REG(R9), op).Get()});
+    corpus.push_back({"cvtsi2sd xmm3, " + Memory(op, "DWORD"), CVTSI2SD(REG(XMM3), op, DWORD).Get()});
+    corpus.push_back({"cvtsi2sd xmm1, " + Memory(op, "QWORD"), CVTSI2SD(REG(XMM1), op).Get()});
+    corpus.push_back({"sqrtsd xmm2, " + Memory(op, "QWORD"), SQRTSD(REG(XMM2), op).Get()});
+    corpus.push_back({"cvttsd2si eax, " + Memory(op, "QWORD"), CVTTSD2SI(REG(RAX), op, DWORD).Get()});
+    corpus.push_back({"sete " + Memory(op, "BYTE"), SETCC(CC_E, op).Get()});
+    corpus.push_back({"setl " + Memory(op, "BYTE"), SETCC(CC_L, op).Get()});
+  }
+  for (int xmm = 0; xmm < 8; ++xmm) {
+    for (int reg = 0; reg < 16; ++reg) {
+      corpus.push_back({"cvtsi2sd " + Xmm(xmm) + ", " + Name(reg, QWORD), CVTSI2SD(REG(xmm), REG(reg)).Get()});
+      corpus.push_back({"cvtsi2sd " + Xmm(xmm) + ", " + Name(reg, DWORD),
+                        CVTSI2SD(REG(xmm), REG(reg), DWORD).Get()});
+      corpus.push_back({"cvttsd2si " + Name(reg, QWORD) + ", " + Xmm(xmm), CVTTSD2SI(REG(reg), REG(xmm)).Get()});
+      corpus.push_back({"cvttsd2si " + Name(reg, DWORD) + ", " + Xmm(xmm),
+                        CVTTSD2SI(REG(reg), REG(xmm), DWORD).Get()});
+    }
+    for (int from = 0; from < 8; ++from) {
+      corpus.push_back({"sqrtsd " + Xmm(xmm) + ", " + Xmm(from), SQRTSD(REG(xmm), REG(from)).Get()});
+    }
+  }
+  const std::pair<Condition, const char*> conditions[] = {{CC_E, "je"},  {CC_NE, "jne"}, {CC_S, "js"},
+                                                          {CC_NS, "jns"}, {CC_L, "jl"},  {CC_GE, "jge"},
+                                                          {CC_LE, "jle"}, {CC_G, "jg"}};
+  for (int off : {0, 100, -100, 100000, -100000}) {
+    corpus.push_back({"{disp32} jmp .+" + std::to_string(5 + off), JMP(IMM32(off)).Get()});
+    corpus.push_back({"jmp .+" + std::to_string(2 + off % 100), JMP(IMM8(off % 100)).Get()});
+    corpus.push_back({"call .+" + std::to_string(5 + off), CALL(IMM32(off)).Get()});
+    for (auto& [cc, mnemonic] : conditions) {
+      corpus.push_back({std::string("{disp32} ") + mnemonic + " .+" + std::to_string(6 + off), JCC(cc, off).Get()});
+    }
+  }
+  corpus.push_back({"cqo", CQO().Get()});
+  corpus.push_back({"ret", RET().Get()});
+  corpus.push_back({"syscall", SYSCALL().Get()});
+  corpus.push_back({"push 100", PUSH(IMM8(100)).Get()});
+  return corpus;
+}
+
+static bool Run(const std::string& command) {
+  if (system(command.c_str()) != 0) {
+    fprintf(stderr, "FAILED: %s\n", command.c_str());
+    return false;
+  }
+  return true;
+}
+
+// Assembles `source` and returns "bytes\tinstruction" per decoded instruction.
+static bool Disassemble(const std::string& dir, const std::string& name, const std::string& source,
+                        std::vector<std::pair<std::string, std::string>>& result) {
+  std::ofstream(dir + "/" + name + ".s") << ".intel_syntax noprefix\n.text\n" << source;
+  if (!Run("as " + dir + "/" + name + ".s -o " + dir + "/" + name + ".o") ||
+      !Run("objdump -d -M intel --insn-width=16 " + dir + "/" + name + ".o > " + dir + "/" + name + ".txt")) {
+    return false;
+  }
+  std::ifstream listing(dir + "/" + name + ".txt");
+  std::string line;
+  while (std::getline(listing, line)) {
+    // "   1f:\t41 ff 54 24 20     \tcall   QWORD PTR [r12+0x20]"
+    size_t first = line.find(":\t");
+    if (first == std::string::npos || line.find('<') != std::string::npos) {
+      continue;
+    }
+    size_t second = line.find('\t', first + 2);
+    std::string bytes = line.substr(first + 2, second == std::string::npos ? std::string::npos : second - first - 2);
+    std::string text = second == std::string::npos ? "" : line.substr(second + 1);
+    bytes.erase(bytes.find_last_not_of(' ') + 1);
+    // Relative targets are printed as absolute addresses, compare them only through the bytes.
+    size_t space = text.find(' ');
+    if (!text.empty() && (text[0] == 'j' || text.starts_with("call")) && text.find("PTR") == std::string::npos &&
+        space != std::string::npos && text.find("0x", space) != std::string::npos) {
+      text = text.substr(0, space);
+    }
+    text.erase(std::remove(text.begin(), text.end(), ' '), text.end());
+    result.emplace_back(bytes, text);
+  }
+  return true;
+}
+
+static std::string Hex(const std::string& bytes) {
+  std::string result;
+  char buffer[4];
+  for (auto i : bytes) {
+    snprintf(buffer, sizeof(buffer), "%02x ", uint8_t(i));
+    result += buffer;
+  }
+  if (!result.empty()) result.pop_back();
+  return result;
+}
+
+// True if making the operand aborts, it is made in a child so the test goes on.
+template <typename Make>
+static bool Rejects(Make make) {
+  pid_t child = fork();
+  if (child == 0) {
+    fclose(stderr);
+    make();
+    _exit(0);
+  }
+  int status = 0;
+  waitpid(child, &status, 0);
+  return WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT;
+}
+
+// Operands the encoder can't express must not turn silently into other ones.
+static bool CheckRejected() {
+#ifdef NDEBUG
+  printf("Rejection of invalid operands is not checked, asserts are off\n");
+  return true;
+#else
+  bool ok = true;
+  if (!Rejects([] { REG(RAX, RSP, 1, 0); })) {
+    fprintf(stderr, "REG(RAX, RSP, 1, 0) is accepted, it would encode as [rax]\n");
+    ok = false;
+  }
+  if (!Rejects([] { REG(RAX, RCX, 3, 0); })) {
+    fprintf(stderr, "REG(RAX, RCX, 3, 0) is accepted, it would encode as [rax+rcx*1]\n");
+    ok = false;
+  }
+  if (Rejects([] { REG(RAX, R12, 8, 0); })) {
+    fprintf(stderr, "REG(RAX, R12, 8, 0) is rejected, R12 is a valid index\n");
+    ok = false;
+  }
+  return ok;
+#endif
+}
+
+static int Check() {
+  if (!CheckRejected()) {
+    return 1;
+  }
+  auto corpus = Corpus();
+  char dir[] = "/tmp/encoder_testXXXXXX";
+  if (!mkdtemp(dir)) {
+    perror("mkdtemp");
+    return 1;
+  }
+  std::string reference;
+  std::string encoded;
+  for (auto& instruction : corpus) {
+    reference += instruction.text + "\n";
+    encoded += ".byte ";
+    for (size_t i = 0; i < instruction.bytes.size(); ++i) {
+      encoded += (i ? ", " : "") + std::to_string(uint8_t(instruction.bytes[i]));
+    }
+    encoded += "\n";
+  }
+  std::vector<std::pair<std::string, std::string>> expected, actual;
+  if (!Disassemble(dir, "reference", reference, expected) || !Disassemble(dir, "encoded", encoded, actual)) {
+    return 1;
+  }
+  Run(std::string("rm -rf ") + dir);
+  if (expected.size() != corpus.size() || actual.size() != corpus.size()) {
+    fprintf(stderr, "Decoded %zu/%zu instructions out of %zu\n", expected.size(), actual.size(), corpus.size());
+    return 1;
+  }
+  size_t exact = 0;
+  size_t failures = 0;
+  for (size_t i = 0; i < corpus.size(); ++i) {
+    if (expected[i].first == Hex(corpus[i].bytes)) {
+      ++exact;
+    } else if (expected[i].second != actual[i].second || actual[i].first != Hex(corpus[i].bytes)) {
+      if (failures++ < 20) {
+        fprintf(stderr, "MISMATCH %s\n  as:      %s  %s\n  encoder: %s  %s\n", corpus[i].text.c_str(),
+                expected[i].first.c_str(), expected[i].second.c_str(), Hex(corpus[i].bytes).c_str(),
+                actual[i].second.c_str());
+      }
+    }
+  }
+  printf("%zu instructions: %zu identical, %zu equivalent, %zu wrong\n", corpus.size(), exact,
+         corpus.size() - exact - failures, failures);
+  return failures != 0;
+}
+
+static int Benchmark(long long count) {
+  // A mix close to what the translator emits.
+  size_t bytes = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (long long i = 0; i < count; i += 8) {
+    int k = int(i & 1023);
+    bytes += MOV(REG(RBX, 0, true), k, DWORD).Get().size();
+    bytes += ADD(REG(RBX), 4).Get().size();
+    bytes += MOV(REG(RAX), REG(RBP, 4 * k, true), DWORD).Get().size();
+    bytes += MOVSXD(REG(RCX), REG(RBX, -4, true)).Get().size();
+    bytes += IMUL(REG(RAX), REG(RCX)).Get().size();
+    bytes += MOV(REG(R12, RCX, 4, -4), REG(RAX), DWORD).Get().size();
+    bytes += CVTSI2SD(REG(XMM0), REG(RBX, -4, true), DWORD).Get().size();
+    bytes += JCC(CC_LE, k).Get().size();
+  }
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+  printf("%lld instructions (%zu bytes) in %.3f s: %.2f M instructions/s\n", count, bytes, elapsed.count(),
+         count / elapsed.count() / 1e6);
+  return 0;
+}
+
+int main(int argc, char** argv) {
+  if (argc > 1 && !strcmp(argv[1], "-b")) {
+    return Benchmark(argc > 2 ? atoll(argv[2]) : 1000000);
+  }
+  return Check();
+}
@@ -1,13 +1,16 @@
 #ifndef LANG_OP_CPP
 #define LANG_OP_CPP
 
+#include <cassert>
 #include <string>
 #include <iostream>
+#include <cstdint>
 
 using std::string;
-// TODO: r8-r15 are not supported
 
 #define REX_PREFIX 0b01001000
+#define REX_EMPTY  0b01000000
+#define SSE_PREFIX 0xf2
 
 #define RAX 0b000
 #define RCX 0b001
@@ -17,117 +20,185 @@ using std::string;
 #define RBP 0b101
 #define RSI 0b110
 #define RDI 0b111
+#define R8  0b1000
+#define R9  0b1001
+#define R10 0b1010
+#define R11 0b1011
+#define R12 0b1100
+#define R13 0b1101
+#define R14 0b1110
+#define R15 0b1111
 
+// SSE registers share the ModR/M numbering with the general purpose ones.
+#define XMM0 0b000
+#define XMM1 0b001
+#define XMM2 0b010
+#define XMM3 0b011
+#define XMM4 0b100
+#define XMM5 0b101
+#define XMM6 0b110
+#define XMM7 0b111
+
+#define NO_INDEX 0xff
 
 using IMM8 = int8_t;
 using IMM32 = int32_t;
 
+// DWORD operands are encoded without REX.W.
+enum OperandSize { DWORD, QWORD };
+
+// Condition codes for Jcc and SETcc.
+enum Condition {
+  CC_E  = 0x4,
+  CC_NE = 0x5,
+  CC_S  = 0x8,
+  CC_NS = 0x9,
+  CC_L  = 0xc,
+  CC_GE = 0xd,
+  CC_LE = 0xe,
+  CC_G  = 0xf
+};
+
+// Register or memory operand [base + index * scale + offset].
 class REG {
 public:
-  REG(size_t ID, int offset = 0, bool is_addr = false) : ID_(ID), offset_(offset), is_addr_(offset != 0 || is_addr) {}
+  REG(size_t ID, int offset = 0, bool is_addr = false)
+      : ID_(ID), index_(NO_INDEX), scale_(1), offset_(offset), is_addr_(offset != 0 || is_addr) {}
+  // SIB index 100 without REX.X means no index, so RSP can't be one. Scale is 1, 2, 4 or 8.
+  REG(size_t ID, size_t index, uint8_t scale, int offset = 0)
+      : ID_(ID), index_(index), scale_(scale), offset_(offset), is_addr_(true) {
+    assert(index != RSP && "RSP can't be an index");
+    assert((scale == 1 || scale == 2 || scale == 4 || scale == 8) && "scale is 1, 2, 4 or 8");
+  }
   uint8_t GetId() const { return ID_; }
   REG& operator [](int a) {
     offset_ = a;
+    is_addr_ = true;
     return *this;
   }
-  bool IsAddr() const { return is_addr_; }
-  int  GetOff() const { return offset_; }
+  bool    IsAddr()   const { return is_addr_; }
+  int     GetOff()   const { return offset_; }
+  bool    HasIndex() const { return index_ != NO_INDEX; }
+  uint8_t GetIndex() const { return index_; }
+  uint8_t GetScale() const { return scale_; }
 private:
   uint8_t ID_;
+  uint8_t index_;
+  uint8_t scale_;
   int offset_;
   bool is_addr_;
 };
 
+inline std::string Imm32(int32_t val) {
+  std::string result;
+  for (int i = 0; i < 4; ++i) {
+    result += std::string(1, char(val & 0b11111111));
+    val >>= 8;
+  }
+  return result;
+}
+
 class Instruction {
 public:
   Instruction() = default;
 
   // Handle REG REG, R/M64 REG, REG R/M64.
-  Instruction(const REG& to, const REG& from) : rex_prefix(1, REX_PREFIX) {
+  Instruction(const REG& to, const REG& from, OperandSize size = QWORD) {
+    if (from.IsAddr())
+      Encode(to.GetId(), from, size);
+    else
+      Encode(from.GetId(), to, size);
+  }
+
+  // Handle R/M64, IMM32
+  Instruction(const REG& to, IMM32 val, OperandSize size = QWORD) {
+    Encode(0, to, size);
+    imm = Imm32(val);
+  }
+
+  std::string Get() { return prefix + rex_prefix + opcode + ModRM + SIB + disp + imm; }
+protected:
+  // ModR/M.reg holds either a register or an opcode extension (/digit), ModR/M.rm holds the R/M operand.
+  // Registers r8-r15 and the SIB index are extended through REX.R, REX.X and REX.B.
+  void Encode(uint8_t reg, const REG& rm, OperandSize size = QWORD) {
+    uint8_t rex = REX_EMPTY;
+    if (size == QWORD)        rex |= 0b1000;
+    if (reg & 0b1000)         rex |= 0b0100;
+    if (rm.HasIndex() && (rm.GetIndex() & 0b1000))
+                              rex |= 0b0010;
+    if (rm.GetId() & 0b1000)  rex |= 0b0001;
+    rex_prefix = rex != REX_EMPTY ? std::string(1, rex) : std::string();
+
     unsigned char result = 0b11000000;
-    if (to.IsAddr()) {
-      if (to.GetOff() == 0) {
-        result = 0b00000000;
-      }
-      else if (to.GetOff() > -128 && to.GetOff() < 128) {
-        result = 0b01000000;
-        disp = std::string(1, to.GetOff());
-      }
-      else
-        result = 0b10000000;
-    }
-    if (from.IsAddr()) {
-      if (from.GetOff() == 0) {
+    uint8_t base = rm.GetId() & 0b111;
+    if (rm.IsAddr()) {
+      // [RBP]/[R13] with mod 00 means RIP or disp32 only, so they always carry a displacement.
+      if (rm.GetOff() == 0 && base != RBP) {
         result = 0b00000000;
       }
-      else if (from.GetOff() > -128 && from.GetOff() < 128) {
+      else if (rm.GetOff() >= -128 && rm.GetOff() < 128) {
         result = 0b01000000;
-        disp = std::string(1, from.GetOff());
+        disp = std::string(1, rm.GetOff());
       }
       else {
         result = 0b10000000;
-        // TODO: 1 byte, 2 byte, 4 bytes to right string version
+        disp = Imm32(rm.GetOff());
+      }
+      // R/M 100 (RSP/R12) is the SIB escape.
+      if (rm.HasIndex() || base == RSP) {
+        uint8_t index = rm.HasIndex() ? (rm.GetIndex() & 0b111) : RSP;
+        uint8_t scale = rm.GetScale() == 8 ? 0b11 : rm.GetScale() == 4 ? 0b10 : rm.GetScale() == 2 ? 0b01 : 0b00;
+        SIB = std::string(1, (scale << 6) + (index << 3) + base);
+        base = RSP;
       }
     }
-    if (from.IsAddr())
-      result += (to.GetId() << 3) + from.GetId();
-    else
-      result += (from.GetId() << 3) + to.GetId();
-    ModRM = std::string(1, result);
-  }
-
-  // Handle R/M64, IMM64
-  Instruction(const REG& to, IMM32 val) : rex_prefix(1, REX_PREFIX) {
-    unsigned char result = 0b11000000;
-    result += to.GetId();
+    result += ((reg & 0b111) << 3) + base;
     ModRM = std::string(1, result);
-    for (int i = 0; i < 4; ++i) {
-      imm += std::string(1, char(val & 0b11111111));
-      val >>= 8;
-    }
   }
 
-  std::string Get() { return rex_prefix + opcode + ModRM + disp + imm; }
-protected:
+  std::string prefix;
   std::string rex_prefix;
   std::string opcode;
   std::string ModRM;
+  std::string SIB;
   std::string disp;
   std::string imm;
 };
 
 class MOV : public Instruction {
 public:
-  MOV(const REG& to, const REG& from) : Instruction(to, from) {
+  MOV(const REG& to, const REG& from, OperandSize size = QWORD) : Instruction(to, from, size) {
     if (from.IsAddr())
       opcode = std::string(1, 0x8b);
     else
       opcode = std::string(1, 0x89);
   }
-  MOV(const REG& to, IMM32 val) : Instruction(to, val) {
+  MOV(const REG& to, IMM32 val, OperandSize size = QWORD) : Instruction(to, val, size) {
     opcode = std::string(1, 0xc7);
   }
 };
 
+// Sign-extends a 32-bit R/M to a 64-bit register.
+class MOVSXD : public Instruction {
+public:
+  MOVSXD(const REG& to, const REG& from) {
+    Encode(to.GetId(), from);
+    opcode = std::string(1, 0x63);
+  }
+};
+
+// PUSH and POP default to 64-bit operands, so they never need REX.W.
 class PUSH : public Instruction {
 public:
   PUSH(const REG& op) {
     if (!op.IsAddr()) {
-      char result = 0x50 + op.GetId();
+      if (op.GetId() & 0b1000)
+        rex_prefix = std::string(1, REX_EMPTY | 0b0001);
+      char result = 0x50 + (op.GetId() & 0b111);
       opcode = std::string(1, result);
     } else {
+      Encode(6, op, DWORD);
       opcode = std::string(1, 0xff);
-      if (-128 < op.GetOff() && op.GetOff() < 128) {
-        ModRM = std::string(1, 0x70 + op.GetId());
-        disp = std::string(1, op.GetOff());
-      } else {
-        ModRM = std::string(1, 0xb0 + op.GetId());
-        int off = op.GetOff();
-        for (int i = 0; i < 4; ++i) {
-          disp += std::string(1, char(off & 0b11111111));
-          off >>= 8;
-        }
-      }
     }
   }
 
@@ -141,31 +212,40 @@ class POP : public Instruction {
 public:
   POP(const REG& op) {
     if (!op.IsAddr()) {
-      char result = 0x58 + op.GetId();
+      if (op.GetId() & 0b1000)
+        rex_prefix = std::string(1, REX_EMPTY | 0b0001);
+      char result = 0x58 + (op.GetId() & 0b111);
       opcode = std::string(1, result);
-      return;
     } else {
+      Encode(0, op, DWORD);
       opcode = std::string(1, 0x8f);
-      if (-128 < op.GetOff() && op.GetOff() < 128) {
-        ModRM = std::string(1, 0b01000000 + op.GetId());
-        disp = std::string(1, op.GetOff());
-      }
-      else {
-        ModRM = std::string(1, 0b10000000 + op.GetId());
-        int off = op.GetOff();
-        for (int i = 0; i < 4; ++i) {
-          disp += std::string(1, char(off & 0b11111111));
-          off >>= 8;
-        }
-      }
     }
   }
 };
 
 class CMP : public Instruction {
 public:
-  CMP(const REG& left, const REG& right) : Instruction(left, right) {
-    opcode = std::string(1, 0x39);
+  CMP(const REG& left, const REG& right, OperandSize size = QWORD) : Instruction(left, right, size) {
+    if (right.IsAddr())
+      opcode = std::string(1, 0x3b);
+    else
+      opcode = std::string(1, 0x39);
+  }
+};
+
+class TEST : public Instruction {
+public:
+  TEST(const REG& left, const REG& right, OperandSize size = QWORD) : Instruction(left, right, size) {
+    opcode = std::string(1, 0x85);
+  }
+};
+
+// Writes 1 to the byte operand if the condition holds and 0 otherwise.
+class SETCC : public Instruction {
+public:
+  SETCC(Condition cc, const REG& op) {
+    Encode(0, op, DWORD);
+    opcode = {0x0f, char(0x90 + cc)};
   }
 };
 
@@ -182,6 +262,10 @@ public:
     opcode = {char(0xeb)};
     disp = {off};
   }
+  explicit JMP(IMM32 off) {
+    opcode = {char(0xe9)};
+    disp = Imm32(off);
+  }
 };
 
 class JE : public Instruction {
@@ -192,14 +276,25 @@ public:
   }
 };
 
+// Near Jcc, rel32 is counted from the end of the instruction.
+class JCC : public Instruction {
+public:
+  JCC(Condition cc, IMM32 off) {
+    opcode = {0x0f, char(0x80 + cc)};
+    disp = Imm32(off);
+  }
+};
+
 class CALL : public Instruction {
 public:
   explicit CALL(IMM32 off) {
     opcode = {char(0xe8)};
-    for (int i = 0; i < 4; ++i) {
-      imm += std::string(1, char(off & 0b11111111));
-      off >>= 8;
-    }
+    imm = Imm32(off);
+  }
+  // Indirect call through a register or memory, default 64-bit operand.
+  explicit CALL(const REG& op) {
+    Encode(2, op, DWORD);
+    opcode = {char(0xff)};
   }
 };
 
@@ -210,20 +305,90 @@ public:
   }
 };
 
+class ADD : public Instruction {
+public:
+  ADD(const REG& to, const REG& from, OperandSize size = QWORD) : Instruction(to, from, size) {
+    if (from.IsAddr())
+      opcode = std::string(1, 0x03);
+    else
+      opcode = std::string(1, 0x01);
+  }
+  ADD(const REG& reg, IMM32 val, OperandSize size = QWORD) : Instruction(reg, val, size) {
+    opcode = {char(0x81)};
+  }
+};
+
 class SUB : public Instruction {
 public:
+  SUB(const REG& to, const REG& from, OperandSize size = QWORD) : Instruction(to, from, size) {
+    if (from.IsAddr())
+      opcode = std::string(1, 0x2b);
+    else
+      opcode = std::string(1, 0x29);
+  }
   explicit SUB(const REG& reg, IMM32 val) {
-    rex_prefix = std::string(1, REX_PREFIX);
+    Encode(5, reg);
     opcode = {char(0x81)};
-    ModRM = std::string(1, 0xe8 + reg.GetId());
-    for (int i = 0; i < 4; ++i) {
-      imm += std::string(1, char(val & 0b11111111));
-      val >>= 8;
-    }
+    imm = Imm32(val);
+  }
+};
+
+class IMUL : public Instruction {
+public:
+  IMUL(const REG& to, const REG& from) {
+    Encode(to.GetId(), from);
+    opcode = {0x0f, char(0xaf)};
+  }
+};
+
+// Signed RDX:RAX / op, quotient goes to RAX and remainder to RDX.
+class IDIV : public Instruction {
+public:
+  explicit IDIV(const REG& op) {
+    Encode(7, op);
+    opcode = {char(0xf7)};
+  }
+};
+
+// Sign-extends RAX into RDX:RAX before IDIV.
+class CQO : public Instruction {
+public:
+  explicit CQO() {
+    rex_prefix = std::string(1, REX_PREFIX);
+    opcode = {char(0x99)};
+  }
+};
+
+// Scalar double <- signed integer. DWORD reads a 32-bit integer.
+class CVTSI2SD : public Instruction {
+public:
+  CVTSI2SD(const REG& to, const REG& from, OperandSize size = QWORD) {
+    prefix = std::string(1, SSE_PREFIX);
+    Encode(to.GetId(), from, size);
+    opcode = {0x0f, 0x2a};
+  }
+};
+
+class SQRTSD : public Instruction {
+public:
+  SQRTSD(const REG& to, const REG& from) {
+    prefix = std::string(1, SSE_PREFIX);
+    Encode(to.GetId(), from, DWORD);
+    opcode = {0x0f, 0x51};
+  }
+};
+
+// Signed integer <- scalar double with truncation. DWORD writes a 32-bit integer.
+class CVTTSD2SI : public Instruction {
+public:
+  CVTTSD2SI(const REG& to, const REG& from, OperandSize size = QWORD) {
+    prefix = std::string(1, SSE_PREFIX);
+    Encode(to.GetId(), from, size);
+    opcode = {0x0f, 0x2c};
   }
 };
 
-void print(const std::string& a) {
+inline void print(const std::string& a) {
   for (auto i : a) {
     printf("%02x ", uint8_t(i));
   }
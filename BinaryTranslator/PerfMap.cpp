@@ -0,0 +1,115 @@
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cstring>
+#include <ctime>
+
+#include "PerfMap.hpp"
+
+// Layouts from tools/perf/Documentation/jitdump-specification.txt.
+struct JitHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t total_size;
+  uint32_t elf_mach;
+  uint32_t pad1;
+  uint32_t pid;
+  uint64_t timestamp;
+  uint64_t flags;
+};
+
+struct JitCodeLoad {
+  uint32_t id;
+  uint32_t total_size;
+  uint64_t timestamp;
+  uint32_t pid;
+  uint32_t tid;
+  uint64_t vma;
+  uint64_t code_addr;
+  uint64_t code_size;
+  uint64_t code_index;
+};
+
+struct JitCodeDebugInfo {
+  uint32_t id;
+  uint32_t total_size;
+  uint64_t timestamp;
+  uint64_t code_addr;
+  uint64_t nr_entry;
+};
+
+// Followed by the file name with its terminating zero.
+struct JitDebugEntry {
+  uint64_t code_addr;
+  uint32_t line;
+  uint32_t discrim;
+};
+
+const uint32_t JIT_MAGIC = 0x4A695444;
+const uint32_t JIT_CODE_LOAD = 0;
+const uint32_t JIT_CODE_DEBUG_INFO = 2;
+const uint32_t EM_X86_64 = 62;
+
+// perf matches jitdump records with samples by CLOCK_MONOTONIC.
+static uint64_t Timestamp() {
+  timespec ts{};
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+PerfMap::PerfMap(bool jitdump) : map(nullptr), dump(nullptr), marker(nullptr), marker_size(0), index(0) {
+  std::string suffix = std::to_string(getpid());
+  map = fopen(("/tmp/perf-" + suffix + ".map").c_str(), "w");
+  if (!jitdump) {
+    return;
+  }
+  dump = fopen(("/tmp/jit-" + suffix + ".dump").c_str(), "w+");
+  if (!dump) {
+    return;
+  }
+  JitHeader header = {JIT_MAGIC, 1, sizeof(JitHeader), EM_X86_64, 0, uint32_t(getpid()), Timestamp(), 0};
+  fwrite(&header, sizeof(header), 1, dump);
+  fflush(dump);
+  // perf record finds the dump through this executable mapping of it.
+  marker_size = sysconf(_SC_PAGESIZE);
+  marker = mmap(nullptr, marker_size, PROT_READ | PROT_EXEC, MAP_PRIVATE, fileno(dump), 0);
+  if (marker == MAP_FAILED) {
+    marker = nullptr;
+  }
+}
+
+PerfMap::~PerfMap() {
+  if (map) fclose(map);
+  if (marker) munmap(marker, marker_size);
+  if (dump) fclose(dump);
+}
+
+void PerfMap::add(const void* code, size_t size, const std::string& name, const std::vector<PerfLine>& lines) {
+  if (map) {
+    fprintf(map, "%lx %zx %s\n", uintptr_t(code), size, name.c_str());
+    fflush(map);
+  }
+  // Debug info has to precede the load of the code it describes.
+  if (dump && !lines.empty()) {
+    size_t total_size = sizeof(JitCodeDebugInfo);
+    for (auto& line : lines) {
+      total_size += sizeof(JitDebugEntry) + strlen(line.file) + 1;
+    }
+    JitCodeDebugInfo record = {JIT_CODE_DEBUG_INFO, uint32_t(total_size), Timestamp(), uintptr_t(code), lines.size()};
+    fwrite(&record, sizeof(record), 1, dump);
+    for (auto& line : lines) {
+      JitDebugEntry entry = {uintptr_t(code) + line.offset, uint32_t(line.line), 0};
+      fwrite(&entry, sizeof(entry), 1, dump);
+      fwrite(line.file, 1, strlen(line.file) + 1, dump);
+    }
+  }
+  if (dump) {
+    JitCodeLoad record = {JIT_CODE_LOAD, uint32_t(sizeof(JitCodeLoad) + name.size() + 1 + size), Timestamp(),
+                          uint32_t(getpid()), uint32_t(syscall(SYS_gettid)), uintptr_t(code), uintptr_t(code),
+                          size, index++};
+    fwrite(&record, sizeof(record), 1, dump);
+    fwrite(name.c_str(), 1, name.size() + 1, dump);
+    fwrite(code, 1, size, dump);
+    fflush(dump);
+  }
+}
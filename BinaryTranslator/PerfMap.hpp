@@ -0,0 +1,36 @@
+#ifndef LANG_PERFMAP_H
+#define LANG_PERFMAP_H
+
+#include <cstdio>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Source line of the code starting at offset from the beginning of a function.
+struct PerfLine {
+  size_t offset;
+  const char* file;
+  int line;
+};
+
+// Describes generated code to Linux perf.
+// /tmp/perf-<pid>.map is enough for `perf report`, /tmp/jit-<pid>.dump (jitdump) also keeps the code bytes,
+// so `perf inject --jit` can annotate it.
+class PerfMap {
+public:
+  explicit PerfMap(bool jitdump);
+  ~PerfMap();
+
+  // Lines only go to the jitdump, perf annotate shows them next to the code.
+  void add(const void* code, size_t size, const std::string& name, const std::vector<PerfLine>& lines = {});
+
+private:
+  FILE* map;
+  FILE* dump;
+  void* marker;
+  size_t marker_size;
+  uint64_t index;
+};
+
+
+#endif //LANG_PERFMAP_H
@@ -1,9 +1,274 @@
-#include "OP.hpp"
-
-int main() {
-//  print(PUSH(REG(RBP, -16)).Get());
-//  print(PUSH(REG(RBP, -129)).Get());
-//  print(MOV(REG(RBP), REG(RSP)).Get());
-  print(MOV(REG(RAX), REG(RBX)).Get());
-//  print(CMP(REG(RAX), 0).Get());
-}
\ No newline at end of file
+#include <sys/mman.h>
+#include <cstddef>
+#include <cstring>
+
+#include "RealASMTranslator.hpp"
+
+// Operand stack slots relative to RBX.
+static REG Top(int depth = 1) { return REG(RBX, -4 * depth, true); }
+
+// r[index] relative to RBP.
+static REG Register(int index) { return REG(RBP, 4 * index, true); }
+
+static REG State(size_t offset) { return REG(R12, int(offset), true); }
+
+static std::string Prologue() {
+  return PUSH(REG(RBX)).Get() + PUSH(REG(RBP)).Get() + PUSH(REG(R12)).Get() + PUSH(REG(R13)).Get() +
+         SUB(REG(RSP), 8).Get() + MOV(REG(R12), REG(RDI)).Get() +
+         MOV(REG(RBP), State(offsetof(NativeState, r))).Get() +
+         MOV(REG(RBX), State(offsetof(NativeState, sp))).Get() +
+         MOV(REG(R13), State(offsetof(NativeState, cmp)), DWORD).Get();
+}
+
+static std::string Sync() {
+  return MOV(State(offsetof(NativeState, sp)), REG(RBX)).Get() +
+         MOV(State(offsetof(NativeState, cmp)), REG(R13), DWORD).Get();
+}
+
+static std::string Epilogue() {
+  return Sync() + ADD(REG(RSP), 8).Get() + POP(REG(R13)).Get() + POP(REG(R12)).Get() + POP(REG(RBP)).Get() +
+         POP(REG(RBX)).Get() + RET().Get();
+}
+
+// Helpers may touch the operand stack and the flags, so both are written back and reloaded.
+static std::string Helper(size_t offset) {
+  return Sync() + MOV(REG(RDI), REG(R12)).Get() + CALL(State(offset)).Get() +
+         MOV(REG(RBX), State(offsetof(NativeState, sp))).Get() +
+         MOV(REG(R13), State(offsetof(NativeState, cmp)), DWORD).Get();
+}
+
+static Condition JumpCondition(Opcode op) {
+  switch (op) {
+    case Opcode::je:  return CC_E;
+    case Opcode::jne: return CC_NE;
+    case Opcode::jb:  return CC_L;
+    case Opcode::jae: return CC_GE;
+    case Opcode::jbe: return CC_LE;
+    default:          return CC_G;
+  }
+}
+
+RealASMTranslator::RealASMTranslator(const int* code, int size) : code(code), size(size), perf(nullptr) {}
+
+RealASMTranslator::~RealASMTranslator() {
+  delete perf;
+  for (auto& [page, length] : pages) {
+    munmap(page, length);
+  }
+}
+
+NativeFunction RealASMTranslator::translate(int entry) {
+  // VM pc -> offset of its native code.
+  std::map<int, int> offsets;
+  if (!collect(entry, offsets)) {
+    return nullptr;
+  }
+  // Position of rel32 -> VM pc it refers to.
+  std::vector<std::pair<size_t, int>> fixups;
+  std::string text = Prologue();
+  if (offsets.begin()->first != entry) {
+    text += JMP(IMM32(0)).Get();
+    fixups.emplace_back(text.size() - 4, entry);
+  }
+  for (auto it = offsets.begin(); it != offsets.end(); ++it) {
+    int pc = it->first;
+    it->second = text.size();
+    if (!evaluate(pc, text, fixups)) {
+      return nullptr;
+    }
+    // Fall through into an instruction that is not laid out next.
+    Opcode op = Opcode(code[pc]);
+    bool falls = code[pc] == LABEL_CODE || (op != Opcode::jmp && op != Opcode::ret && op != Opcode::end);
+    int next = code[pc] == LABEL_CODE ? pc + 1 : pc + 1 + OPCODE_ARGC[code[pc]];
+    auto following = std::next(it);
+    if (falls && (following == offsets.end() || following->first != next)) {
+      text += JMP(IMM32(0)).Get();
+      fixups.emplace_back(text.size() - 4, next);
+    }
+  }
+  for (auto& [position, target] : fixups) {
+    int32_t rel = offsets[target] - int(position + 4);
+    memcpy(&text[position], &rel, sizeof(rel));
+  }
+  return install(text, entry, offsets);
+}
+
+void RealASMTranslator::enable_profiling(std::map<int, std::string> names,
+                                         std::map<int, std::pair<std::string, int>> lines, bool jitdump) {
+  this->names = std::move(names);
+  this->lines = std::move(lines);
+  delete perf;
+  perf = new PerfMap(jitdump);
+}
+
+bool RealASMTranslator::collect(int entry, std::map<int, int>& offsets) {
+  std::vector<int> queue = {entry};
+  while (!queue.empty()) {
+    int pc = queue.back();
+    queue.pop_back();
+    if (pc < 0 || pc >= size) {
+      return false;
+    }
+    if (offsets.contains(pc)) {
+      continue;
+    }
+    offsets[pc] = 0;
+    if (code[pc] == LABEL_CODE) {
+      queue.push_back(pc + 1);
+      continue;
+    }
+    if (code[pc] < 0 || code[pc] >= int(sizeof(OPCODE_ARGC) / sizeof(OPCODE_ARGC[0])) ||
+        pc + OPCODE_ARGC[code[pc]] >= size) {
+      return false;
+    }
+    switch (Opcode(code[pc])) {
+      case Opcode::ret:
+      case Opcode::end:
+        break;
+      case Opcode::jmp:
+        queue.push_back(code[pc + 1]);
+        break;
+      case Opcode::je:
+      case Opcode::jne:
+      case Opcode::jb:
+      case Opcode::ja:
+      case Opcode::jae:
+      case Opcode::jbe:
+        queue.push_back(code[pc + 1]);
+        queue.push_back(pc + 2);
+        break;
+      default:
+        queue.push_back(pc + 1 + OPCODE_ARGC[code[pc]]);
+    }
+  }
+  return true;
+}
+
+bool RealASMTranslator::evaluate(int pc, std::string& out, std::vector<std::pair<size_t, int>>& fixups) {
+  if (code[pc] == LABEL_CODE) {
+    return true;
+  }
+  const int* arg = code + pc + 1;
+  switch (Opcode(code[pc])) {
+    case Opcode::push:
+      out += MOV(REG(RBX, 0, true), arg[0], DWORD).Get() + ADD(REG(RBX), 4).Get();
+      break;
+    case Opcode::pop:
+      out += SUB(REG(RBX), 4).Get();
+      break;
+    case Opcode::pushr:
+      out += MOV(REG(RAX), Register(arg[0]), DWORD).Get();
+      out += MOV(REG(RBX, 0, true), REG(RAX), DWORD).Get() + ADD(REG(RBX), 4).Get();
+      break;
+    case Opcode::popr:
+      out += MOV(REG(RAX), Top(), DWORD).Get() + SUB(REG(RBX), 4).Get();
+      out += MOV(Register(arg[0]), REG(RAX), DWORD).Get();
+      break;
+    case Opcode::movi:
+      out += MOV(Register(arg[0]), arg[1], DWORD).Get();
+      break;
+    case Opcode::mov:
+      out += MOV(REG(RAX), Register(arg[1]), DWORD).Get() + MOV(Register(arg[0]), REG(RAX), DWORD).Get();
+      break;
+    case Opcode::addi:
+      out += ADD(Register(arg[0]), arg[1], DWORD).Get();
+      break;
+    case Opcode::add:
+    case Opcode::sub:
+    case Opcode::mul:
+    case Opcode::div:
+      out += MOVSXD(REG(RAX), Top(2)).Get() + MOVSXD(REG(RCX), Top(1)).Get();
+      if (Opcode(code[pc]) == Opcode::add) {
+        out += ADD(REG(RAX), REG(RCX)).Get();
+      } else if (Opcode(code[pc]) == Opcode::sub) {
+        out += SUB(REG(RAX), REG(RCX)).Get();
+      } else if (Opcode(code[pc]) == Opcode::mul) {
+        out += IMUL(REG(RAX), REG(RCX)).Get();
+      } else {
+        out += CQO().Get() + IDIV(REG(RCX)).Get();
+      }
+      out += SUB(REG(RBX), 4).Get() + MOV(Top(), REG(RAX), DWORD).Get();
+      break;
+    case Opcode::sqr:
+      out += MOVSXD(REG(RAX), Top()).Get() + IMUL(REG(RAX), REG(RAX)).Get();
+      out += MOV(Top(), REG(RAX), DWORD).Get();
+      break;
+    case Opcode::sqrt:
+      // 32-bit conversion back matches int(std::sqrt(arg)) in the interpreter, NaN included.
+      out += CVTSI2SD(REG(XMM0), Top(), DWORD).Get() + SQRTSD(REG(XMM0), REG(XMM0)).Get();
+      out += CVTTSD2SI(REG(RAX), REG(XMM0), DWORD).Get() + MOV(Top(), REG(RAX), DWORD).Get();
+      break;
+    case Opcode::less:
+    case Opcode::equal:
+      out += MOV(REG(RAX), Top(2), DWORD).Get() + CMP(REG(RAX), Top(1), DWORD).Get();
+      out += MOV(Top(2), 0, DWORD).Get();
+      out += SETCC(Opcode(code[pc]) == Opcode::less ? CC_L : CC_E, Top(2)).Get();
+      out += SUB(REG(RBX), 4).Get();
+      break;
+    case Opcode::cmp:
+      out += MOV(REG(RAX), Register(arg[0]), DWORD).Get() + SUB(REG(RAX), Register(arg[1]), DWORD).Get();
+      out += MOV(REG(R13), REG(RAX), DWORD).Get();
+      break;
+    case Opcode::cmptop:
+      out += MOV(REG(RAX), Top(2), DWORD).Get() + SUB(REG(RAX), Top(1), DWORD).Get();
+      out += MOV(REG(R13), REG(RAX), DWORD).Get() + SUB(REG(RBX), 8).Get();
+      break;
+    case Opcode::jmp:
+      out += JMP(IMM32(0)).Get();
+      fixups.emplace_back(out.size() - 4, arg[0]);
+      break;
+    case Opcode::je:
+    case Opcode::jne:
+    case Opcode::jb:
+    case Opcode::ja:
+    case Opcode::jae:
+    case Opcode::jbe:
+      out += TEST(REG(R13), REG(R13), DWORD).Get() + JCC(JumpCondition(Opcode(code[pc])), 0).Get();
+      fixups.emplace_back(out.size() - 4, arg[0]);
+      break;
+    case Opcode::call:
+      out += MOV(REG(RSI), arg[0], DWORD).Get();
+      out += Helper(offsetof(NativeState, call));
+      break;
+    case Opcode::in:
+      out += Helper(offsetof(NativeState, in));
+      break;
+    case Opcode::out:
+      out += Helper(offsetof(NativeState, out));
+      break;
+    case Opcode::end:
+      out += Helper(offsetof(NativeState, end));
+      break;
+    case Opcode::ret:
+      out += Epilogue();
+      break;
+    default:
+      return false;
+  }
+  return true;
+}
+
+NativeFunction RealASMTranslator::install(const std::string& text, int entry, const std::map<int, int>& offsets) {
+  void* page = mmap(nullptr, text.size(), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (page == MAP_FAILED) {
+    return nullptr;
+  }
+  memcpy(page, text.data(), text.size());
+  if (mprotect(page, text.size(), PROT_READ | PROT_EXEC) != 0) {
+    munmap(page, text.size());
+    return nullptr;
+  }
+  pages.emplace_back(page, text.size());
+  if (perf) {
+    std::vector<PerfLine> code_lines;
+    for (auto& [pc, offset] : offsets) {
+      auto line = lines.upper_bound(pc);
+      if (line != lines.begin()) {
+        --line;
+        code_lines.push_back({size_t(offset), line->second.first.c_str(), line->second.second});
+      }
+    }
+    perf->add(page, text.size(), names.contains(entry) ? names[entry] : "vm_" + std::to_string(entry), code_lines);
+  }
+  return NativeFunction(page);
+}
@@ -1,23 +1,57 @@
 #ifndef LANG_REALASMTRANSLATOR_H
 #define LANG_REALASMTRANSLATOR_H
 
-#include "../Compiler/common.h"
+#include <vector>
+#include <map>
+
+#include "../ASM/codegen/opcodes.h"
 #include "OP.hpp"
+#include "PerfMap.hpp"
+
+// VM state shared between the interpreter and the native code.
+struct NativeState {
+  int*  r;        // register file
+  int*  sp;       // first free slot of the operand stack
+  int   cmp;      // result of the last comparison, its sign and zero are the VM flags
+  void* runtime;  // passed back to the helpers
+  void (*call)(NativeState* state, int target);
+  void (*in)(NativeState* state);
+  void (*out)(NativeState* state);
+  void (*end)(NativeState* state);
+};
+
+using NativeFunction = void (*)(NativeState*);
 
+// Translates VM functions to x86-64.
+// Generated code keeps the operand stack pointer in RBX, the register file in RBP,
+// NativeState in R12 and the comparison result in R13D. Everything that leaves the function
+// (call, in, out, end) goes through the helpers in NativeState.
 class RealASMTranslator {
 public:
-  RealASMTranslator(Node* root);
+  RealASMTranslator(const int* code, int size);
+  ~RealASMTranslator();
 
-private:
-  Node* root;
+  // Translates every instruction reachable from the function entry (its label).
+  // Returns nullptr if some opcode has no native version.
+  NativeFunction translate(int entry);
+
+  // Reports every translated function to perf, named after its label when `names` has it.
+  // `lines` maps the pcs where the source line changes to that line, the jitdump gets the line of every instruction.
+  void enable_profiling(std::map<int, std::string> names, std::map<int, std::pair<std::string, int>> lines,
+                        bool jitdump);
 
-  void evaluate(Node* node, /* FILE* file , */ const std::string& func);
+private:
+  const int* code;
+  int size;
+  std::map<int, std::string> names;
+  std::map<int, std::pair<std::string, int>> lines;
+  PerfMap* perf;
+  std::vector<std::pair<void*, size_t>> pages;
 
-  int global_var;
-  int max_var;
-  int return_reg;
-  int exp_cnt;
+  bool collect(int entry, std::map<int, int>& offsets);
+  bool evaluate(int pc, std::string& out, std::vector<std::pair<size_t, int>>& fixups);
+  NativeFunction install(const std::string& text, int entry, const std::map<int, int>& offsets);
 };
 
 
-#endif //LANG_ASMTRANSLATOR_H
+#endif //LANG_REALASMTRANSLATOR_H
@@ -1,135 +1,337 @@
 #include "ASMTranslator.h"
 
-ASMTranslator::ASMTranslator(const char* filename, Node* root, struct SYMBOL_TABLE& SYMBOL_TABLE) : root(root), TABLE(SYMBOL_TABLE), return_reg(101), exp_cnt(0), global_var(TABLE.global_var), max_var(TABLE.max_var) {
+#include <charconv>
+
+// Scratch registers above return_reg, a > b swaps its operands through them and becomes b < a.
+// Subtracting the operands instead would overflow.
+constexpr int SWAP_FIRST = 102;
+constexpr int SWAP_SECOND = 103;
+
+// Code of the binary operators after their operands, the processor only has less and equal for comparisons.
+struct OperatorCode {
+    int size;
+    std::array<std::pair<Opcode, int>, 7> commands;
+};
+
+static constexpr std::array<OperatorCode, OPERATOR_TEXT.size()> OPERATOR_CODE = [] {
+    std::array<OperatorCode, OPERATOR_TEXT.size()> code{};
+    code[int(Operator::ADD)] = {1, {{{Opcode::add, 0}}}};
+    code[int(Operator::SUB)] = {1, {{{Opcode::sub, 0}}}};
+    code[int(Operator::MUL)] = {1, {{{Opcode::mul, 0}}}};
+    code[int(Operator::DIV)] = {1, {{{Opcode::div, 0}}}};
+    code[int(Operator::LESS)] = {1, {{{Opcode::less, 0}}}};
+    code[int(Operator::EQUAL)] = {1, {{{Opcode::equal, 0}}}};
+    code[int(Operator::NOT_EQUAL)] = {3, {{{Opcode::equal, 0}, {Opcode::push, 0}, {Opcode::equal, 0}}}};
+    code[int(Operator::GREATER_EQUAL)] = {3, {{{Opcode::less, 0}, {Opcode::push, 0}, {Opcode::equal, 0}}}};
+    code[int(Operator::GREATER)] = {5, {{{Opcode::popr, SWAP_FIRST}, {Opcode::popr, SWAP_SECOND},
+                                         {Opcode::pushr, SWAP_FIRST}, {Opcode::pushr, SWAP_SECOND},
+                                         {Opcode::less, 0}}}};
+    code[int(Operator::LESS_EQUAL)] = {7, {{{Opcode::popr, SWAP_FIRST}, {Opcode::popr, SWAP_SECOND},
+                                            {Opcode::pushr, SWAP_FIRST}, {Opcode::pushr, SWAP_SECOND},
+                                            {Opcode::less, 0}, {Opcode::push, 0}, {Opcode::equal, 0}}}};
+    return code;
+}();
+
+ASMTranslator::ASMTranslator(const char* filename, Node* root, const Interner& names, const struct SYMBOL_TABLE& SYMBOL_TABLE, bool object) : root(root), names(names), TABLE(SYMBOL_TABLE), object(object), function_pc(object ? names.size() : 0, -1), return_reg(101), exp_cnt(0), global_var(TABLE.global_var), max_var(TABLE.max_var), sqrt_symbol(names.find("sqrt")) {
+    // A module without main is only linked into other programs.
+    if (TABLE.main != Interner::NO_SYMBOL) {
+        command(Opcode::jmp, Label{Label::FUNCTION, TABLE.main});
+    }
+    for (Node* i : *root) {
+        if (i->kind == NodeKind::FUNCTION) {
+            evaluate(i);
+        }
+    }
+    if (object) {
+        write_object();
+    }
     FILE* f = fopen(filename, "w");
-    fprintf(f, "jmp main\n");
-    for (auto& i : root->children) {
-        evaluate(i, f, i->data);
+    if (!f) {
+        fprintf(stderr, "Can't open %s\n", filename);
+        exit(1);
     }
+    fwrite(code.data(), 1, code.size(), f);
     fclose(f);
 }
 
-void ASMTranslator::evaluate(Node* node, FILE* file, const std::string& func) {
-    if (node->type == TokenType::IDENTIFICATOR) {
-        if (node->children.empty()) {
-            fprintf(file, "pushr r%d\n", TABLE.TABLE[func][node->data]);
-        }
-        else {
-            if (node->data == "sqrt") {
-                evaluate(node->children[0], file, func);
-                fprintf(file, "sqrt\n");
-            } else {
-                for (int i = global_var; i < max_var; ++i) {
-                    fprintf(file, "pushr r%d\n", i);
-                }
-                evaluate(node->children[0], file, func);
-                fprintf(file, "call %s\n", node->data.c_str());
-                for (int i = max_var - 1; i >= global_var; --i) {
-                    fprintf(file, "popr r%d\n", i);
-                }
-                fprintf(file, "pushr r%d\n", return_reg);
-            }
-        }
+void ASMTranslator::number(long long value) {
+    char digits[24];
+    code.append(digits, std::to_chars(digits, digits + sizeof(digits), value).ptr);
+}
+
+void ASMTranslator::label_name(Label label) {
+    switch (label.kind) {
+        case Label::WHILE:
+            code += "while";
+            number(label.id);
+            break;
+        case Label::NOTIF:
+            code += "notif";
+            number(label.id);
+            break;
+        case Label::FUNCTION:
+            code += names.name(label.id);
+            break;
+    }
+}
+
+void ASMTranslator::command(Opcode opcode) {
+    ++instruction_count;
+    if (object) {
+        cells.push_back(int(opcode));
+        return;
     }
-    else if (node->type == TokenType::INTEGER_LITERAL) {
-        fprintf(file, "push %s\n", node->data.c_str());
+    code += OPCODE_NAME[int(opcode)];
+    code += '\n';
+}
+
+void ASMTranslator::command(Opcode opcode, long long arg) {
+    ++instruction_count;
+    // Cells of the processor are int, a wider literal would silently wrap.
+    if (arg < INT32_MIN || arg > INT32_MAX) {
+        fprintf(stderr, "FAIL literal %lld does not fit in 32 bits\n", arg);
+        exit(1);
     }
-    else if (node->type == TokenType::FUNCTION) {
-        fprintf(file, "$%s\n", node->data.c_str());
-        for (int i = node->children[0]->children.size() + global_var - 1; i >= global_var; --i) {
-            fprintf(file, "popr r%d\n", i);
-        }
-        evaluate(node->children[1], file, func);
-        if (node->data == "main") {
-            fprintf(file, "end\n");
-        } else {
-            fprintf(file, "ret\n");
-        }
+    if (object) {
+        cells.push_back(int(opcode));
+        cells.push_back(int(arg));
+        return;
+    }
+    code += OPCODE_NAME[int(opcode)];
+    code += OPCODE_ARGTYPE[int(opcode)][0] == 1 ? " r" : " ";
+    number(arg);
+    code += '\n';
+}
 
+void ASMTranslator::command(Opcode opcode, Label target) {
+    ++instruction_count;
+    if (object) {
+        cells.push_back(int(opcode));
+        references.emplace_back(cells.size(), target);
+        cells.push_back(-1);
+        return;
+    }
+    code += OPCODE_NAME[int(opcode)];
+    code += ' ';
+    label_name(target);
+    code += '\n';
+}
+
+// Like ASM/compile, the first definition of a label wins.
+void ASMTranslator::define(Label label) {
+    if (!object) {
+        code += '$';
+        label_name(label);
+        code += '\n';
+        return;
+    }
+    int& pc = label_pc(label);
+    if (pc < 0) {
+        pc = cells.size();
+        definitions.emplace_back(cells.size(), label);
+    }
+    cells.push_back(LABEL_CODE);
+}
+
+// -1 until the label is defined.
+int& ASMTranslator::label_pc(Label label) {
+    if (label.kind == Label::FUNCTION) {
+        return function_pc[label.id];
+    }
+    if (label.id >= local_pc.size()) {
+        local_pc.resize(label.id + 1, -1);
     }
-    else if (node->type == TokenType::OPERATOR) {
-        if (node->data == "=") {
-            evaluate(node->children[1], file, func);
-            fprintf(file, "popr r%d\n", TABLE.TABLE[func][node->children[0]->data]);
+    return local_pc[label.id];
+}
+
+// The sections of ASM/compile -c: every label, the references to functions defined elsewhere and the cells
+// holding pcs of the object. An object that imports nothing runs as it is.
+void ASMTranslator::write_object() {
+    std::vector<std::pair<int, Label>> imports;
+    std::vector<int> relocations;
+    for (auto [pc, label] : references) {
+        int target = label_pc(label);
+        if (target < 0) {
+            imports.emplace_back(pc, label);
         } else {
-            for (auto& j : node->children) {
-                evaluate(j, file, func);
-            }
-            if (node->data == "+") {
-                fprintf(file, "add\n");
+            cells[pc] = target;
+            relocations.push_back(pc);
+        }
+    }
+    for (int cell : cells) {
+        number(cell);
+        code += ' ';
+    }
+    code += "\n.exports";
+    for (auto [pc, label] : definitions) {
+        code += ' ';
+        label_name(label);
+        code += ' ';
+        number(pc);
+    }
+    code += "\n.imports";
+    for (auto [pc, label] : imports) {
+        code += ' ';
+        label_name(label);
+        code += ' ';
+        number(pc);
+    }
+    code += "\n.relocations";
+    for (int pc : relocations) {
+        code += ' ';
+        number(pc);
+    }
+    code += '\n';
+}
+
+// The stack of frames stands for the recursion, so deep trees take no native stack.
+void ASMTranslator::evaluate(Node* node) {
+    enter(node);
+    while (!stack.empty()) {
+        Frame& top = stack.back();
+        if (top.next != top.end) {
+            Node* child = *top.next++;
+            if (child) {
+                enter(child);
+            } else {
+                after_child(top);
             }
-            if (node->data == "-") {
-                if (node->children.size() == 1) {
-                    fprintf(file, "push -1\n"
-                                  "mul\n");
-                } else {
-                    fprintf(file, "sub\n");
+            continue;
+        }
+        Frame done = top;
+        stack.pop_back();
+        leave(done);
+        if (!stack.empty()) {
+            after_child(stack.back());
+        }
+    }
+}
+
+// Code before the children, and which children are written.
+void ASMTranslator::enter(Node* node) {
+    Frame frame = {node, node->begin(), node->begin(), node->end(), 0, 0};
+    switch (node->kind) {
+        case NodeKind::IDENTIFIER:
+            command(Opcode::pushr, node->slot);
+            break;
+        case NodeKind::CALL:
+            if (node->symbol != sqrt_symbol) {
+                for (int i = global_var; i < max_var; ++i) {
+                    command(Opcode::pushr, i);
                 }
             }
-            if (node->data == "*") {
-                fprintf(file, "mul\n");
+            break;
+        case NodeKind::INTEGER_LITERAL:
+            command(Opcode::push, node->value);
+            break;
+        case NodeKind::FUNCTION:
+            define({Label::FUNCTION, node->symbol});
+            for (int i = (*node)[0]->count + global_var - 1; i >= global_var; --i) {
+                command(Opcode::popr, i);
             }
-            if (node->data == "/") {
-                fprintf(file, "div\n");
+            frame.first = frame.next = node->begin() + 1;
+            break;
+        case NodeKind::OPERATOR:
+            if (node->op == Operator::ASSIGN) {
+                frame.first = frame.next = node->begin() + 1;
             }
-            if (node->data == "<") {
-                fprintf(file, "less\n");
+            break;
+        case NodeKind::OUT:
+            frame.first = frame.next = (*node)[0]->begin();
+            frame.end = (*node)[0]->end();
+            break;
+        case NodeKind::IN:
+            for (Node* i : *(*node)[0]) {
+                command(Opcode::in);
+                command(Opcode::popr, i->slot);
             }
-            if (node->data == "==") {
-                fprintf(file, "equal\n");
-            }
-        }
+            frame.next = frame.end;
+            break;
+        case NodeKind::DATA:
+            frame.next = frame.end;
+            break;
+        case NodeKind::IF:
+            frame.label = exp_cnt++;
+            break;
+        case NodeKind::WHILE:
+            frame.label = exp_cnt++;
+            frame.exit = exp_cnt++;
+            define({Label::WHILE, uint32_t(frame.label)});
+            break;
+        default:
+            break;
     }
-    else if (node->data == "COMPOUND" || node->data == "STAT") {
-        for (auto& j : node->children) {
-            evaluate(j, file, func);
-        }
-    }
-    else if (node->data == "ARG") {
-        for (auto& j : node->children) {
-            evaluate(j, file, func);
-        }
-        return;
+    stack.push_back(frame);
+}
+
+void ASMTranslator::after_child(const Frame& frame) {
+    bool condition = frame.next - frame.first == 1;
+    switch (frame.node->kind) {
+        case NodeKind::OUT:
+            command(Opcode::out);
+            command(Opcode::pop);
+            break;
+        case NodeKind::IF:
+        case NodeKind::WHILE:
+            if (condition) {
+                command(Opcode::push, 0);
+                command(Opcode::cmptop);
+                command(Opcode::je, Label{Label::NOTIF, uint32_t(frame.node->kind == NodeKind::IF ? frame.label : frame.exit)});
+            }
+            break;
+        default:
+            break;
     }
-    else if (node->type == TokenType::KEYWORD) {
-        if (node->data == "out") {
-            for (auto& i : node->children[0]->children) {
-                evaluate(i, file, func);
-                fprintf(file, "out\n"
-                              "pop\n");
+}
+
+// Code after the children.
+void ASMTranslator::leave(const Frame& frame) {
+    Node* node = frame.node;
+    switch (node->kind) {
+        case NodeKind::CALL:
+            if (node->symbol == sqrt_symbol) {
+                command(Opcode::sqrt);
+            } else {
+                command(Opcode::call, Label{Label::FUNCTION, node->symbol});
+                for (int i = max_var - 1; i >= global_var; --i) {
+                    command(Opcode::popr, i);
+                }
+                command(Opcode::pushr, return_reg);
             }
-        }
-        else if (node->data == "in") {
-            for (auto& i : node->children[0]->children) {
-                fprintf(file, "in\n"
-                              "popr r%d\n", TABLE.TABLE[func][i->data]);
+            break;
+        case NodeKind::FUNCTION:
+            command(node->symbol == TABLE.main ? Opcode::end : Opcode::ret);
+            break;
+        case NodeKind::OPERATOR:
+            if (node->op == Operator::ASSIGN) {
+                command(Opcode::popr, (*node)[0]->slot);
+            } else if (node->op == Operator::SUB && node->count == 1) {
+                command(Opcode::push, -1);
+                command(Opcode::mul);
+            } else {
+                const OperatorCode& operation = OPERATOR_CODE[int(node->op)];
+                for (int i = 0; i < operation.size; ++i) {
+                    auto [opcode, arg] = operation.commands[i];
+                    if (OPCODE_ARGC[int(opcode)] > 0) {
+                        command(opcode, arg);
+                    } else {
+                        command(opcode);
+                    }
+                }
             }
-        }
-        else if (node->data == "if") {
-            int cur_cnt = exp_cnt++;
-            evaluate(node->children[0], file, func);
-            fprintf(file, "push 0\n"
-                          "cmptop\n"
-                          "je notif%d\n", cur_cnt);
-            evaluate(node->children[1], file, func);
-            fprintf(file, "$notif%d\n", cur_cnt);
-        }
-        else if (node->data == "return") {
-            evaluate(node->children[0], file, func);
-            fprintf(file, "popr r%d\n", return_reg);
-            fprintf(file, "ret\n");
-        }
-        else if (node->data == "while") {
-            int cur_cnt = exp_cnt++;
-            int exit_cnt = exp_cnt++;
-            fprintf(file, "$while%d\n", cur_cnt);
-            evaluate(node->children[0], file, func);
-            fprintf(file, "push 0\n"
-                          "cmptop\n"
-                          "je notif%d\n", exit_cnt);
-            evaluate(node->children[1], file, func);
-            fprintf(file, "jmp while%d\n"
-                          "$notif%d\n", cur_cnt, exit_cnt);
-        }
+            break;
+        case NodeKind::IF:
+            define({Label::NOTIF, uint32_t(frame.label)});
+            break;
+        case NodeKind::RETURN:
+            command(Opcode::popr, return_reg);
+            command(Opcode::ret);
+            break;
+        case NodeKind::WHILE:
+            command(Opcode::jmp, Label{Label::WHILE, uint32_t(frame.label)});
+            define({Label::NOTIF, uint32_t(frame.exit)});
+            break;
+        default:
+            break;
     }
-}
\ No newline at end of file
+}
@@ -6,21 +6,69 @@
 #define LANG_ASMTRANSLATOR_H
 
 #include "common.h"
+#include "codegen/opcodes.h"
 
 class ASMTranslator {
 public:
-    ASMTranslator(const char* filename, Node* root, SYMBOL_TABLE& SYMBOL_TABLE);
+    // With object set the file is the object ASM/compile -c would make of the ASM, else the ASM itself.
+    ASMTranslator(const char* filename, Node* root, const Interner& names, const SYMBOL_TABLE& SYMBOL_TABLE,
+                  bool object = false);
+
+    size_t get_instruction_count() const { return instruction_count; }
 
 private:
     Node* root;
-    SYMBOL_TABLE& TABLE;
+    const Interner& names;
+    const SYMBOL_TABLE& TABLE;
+
+    // Node whose code is being written, next is its child to write next.
+    struct Frame {
+        Node*        node;
+        Node* const* first;
+        Node* const* next;
+        Node* const* end;
+        int          label;
+        int          exit;
+    };
+    std::vector<Frame> stack;
+
+    // whileN and notifN share the numbers, functions are named by their symbol.
+    struct Label {
+        enum Kind : uint8_t { WHILE, NOTIF, FUNCTION } kind;
+        uint32_t id;
+    };
+
+    // The whole program is written here and goes to the file with one write.
+    std::string code;
+
+    // Object: the cells, where the labels are and the cells referring to them.
+    bool object;
+    std::vector<int> cells;
+    std::vector<int> local_pc;
+    std::vector<int> function_pc;
+    std::vector<std::pair<int, Label>> definitions;
+    std::vector<std::pair<int, Label>> references;
+    size_t instruction_count = 0;
+
+    void command(Opcode opcode);
+    void command(Opcode opcode, long long arg);
+    void command(Opcode opcode, Label target);
+    void define(Label label);
+    int& label_pc(Label label);
+    void label_name(Label label);
+    void number(long long value);
+    void write_object();
 
-    void evaluate(Node* node, FILE* file, const std::string& func);
+    void evaluate(Node* node);
+    void enter(Node* node);
+    void after_child(const Frame& frame);
+    void leave(const Frame& frame);
 
     int global_var;
     int max_var;
     int return_reg;
     int exp_cnt;
+    uint32_t sqrt_symbol;
 };
 
 
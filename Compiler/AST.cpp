@@ -1,28 +1,30 @@
 #include "AST.h"
 
-AST::AST(const std::vector<Token>& tokens, const std::map<std::string, Keyword>& keywords) : ptr(0), keywords(keywords), tokens(tokens), root(nullptr), err_code(ErrorCode::NO_ERROR){
-    root = new Node("ROOT");
-    while (tokens[ptr].type != TokenType::NULL_TYPE) {
-        if (tokens[ptr].type == TokenType::KEYWORD) {
-            Keyword current_keyword = keywords.at(std::string(tokens[ptr].lexeme.start, tokens[ptr].lexeme.size));
+AST::AST(Lexer& lexer) : ptr(0), lexer(lexer), root(nullptr), node_count(0), err_code(ErrorCode::NO_ERROR){
+    size_t mark = pending.size();
+    while (current().type != TokenType::NULL_TYPE) {
+        if (current().type == TokenType::KEYWORD) {
+            Keyword current_keyword = *find_keyword(lexeme());
             if (current_keyword == Keyword::DATA) {
-                ptr++;
-                root->children.push_back(get_data());
+                advance();
+                pending.push_back(get_data());
             } else {
                 err_code = ErrorCode::DATA_ERROR;
                 raise_syntax_error();
             }
         }
         else {
-            root->children.push_back(get_function());
+            pending.push_back(get_function());
         }
     }
+    root = make(NodeKind::ROOT, mark);
 }
 
 Node* AST::get_identificator() {
-    if (tokens[ptr].type == TokenType::IDENTIFICATOR) {
-        Node* result = new Node(std::string(tokens[ptr].lexeme.start, tokens[ptr].lexeme.size), TokenType::IDENTIFICATOR);
-        ptr++;
+    if (current().type == TokenType::IDENTIFICATOR) {
+        Node* result = make(NodeKind::IDENTIFIER, pending.size());
+        result->symbol = names.intern(lexeme());
+        advance();
         return result;
     }
     else {
@@ -31,113 +33,150 @@ Node* AST::get_identificator() {
 }
 
 Node* AST::get_arguments() {
-    Node* result = new Node("ARG");
+    size_t mark = pending.size();
     Node* first_arg = get_identificator();
     if (first_arg) {
-        result->children.push_back(first_arg);
+        pending.push_back(first_arg);
     }
-    while (*tokens[ptr].lexeme.start == ',') {
-        ptr++;
-        result->children.push_back(get_identificator());
+    while (*current().lexeme.start == ',') {
+        advance();
+        pending.push_back(get_identificator());
     }
-    return result;
+    return make(NodeKind::ARG, mark);
 }
 
 
 
 Node* AST::get_function() {
     Node *result = get_identificator();
-    if (*tokens[ptr].lexeme.start == '(') {
-        ptr++;
-        result->children.push_back(get_arguments());
+    if (!result) {
+        err_code = ErrorCode::FUNCTION_ERROR;
+        raise_syntax_error();
+    }
+    size_t mark = pending.size();
+    if (*current().lexeme.start == '(') {
+        advance();
+        pending.push_back(get_arguments());
     } else {
         err_code = ErrorCode::FUNCTION_ERROR;
         raise_syntax_error();
     }
-    if (*tokens[ptr].lexeme.start == ')') {
-        ptr++;
+    if (*current().lexeme.start == ')') {
+        advance();
     } else {
         err_code = ErrorCode::FUNCTION_ERROR;
         raise_syntax_error();
     }
 
-    result->children.push_back(get_statement());
-    result->type = TokenType::FUNCTION;
+    pending.push_back(get_statement());
+    result->kind = NodeKind::FUNCTION;
+    attach(result, mark);
     return result;
 }
 
+// Blocks, if and while wait on blocks until their statements are parsed, so nesting takes no native stack.
 Node* AST::get_statement() {
-    Node* result = nullptr;
-    if (*(tokens[ptr].lexeme.start) == '{') {
-        result = new Node("COMPOUND");
-        ptr++;
-        while (*tokens[ptr].lexeme.start != '}') {
-            result->children.push_back(get_statement());
+    size_t base = blocks.size();
+    for (;;) {
+        bool opened = false;
+        Node* done = nullptr;
+        if (*current().lexeme.start == '{') {
+            advance();
+            blocks.push_back({NodeKind::COMPOUND, pending.size()});
+            opened = true;
+        }
+        else if (current().type == TokenType::KEYWORD &&
+                 (find_keyword(lexeme()) == Keyword::IF || find_keyword(lexeme()) == Keyword::WHILE)) {
+            NodeKind kind = find_keyword(lexeme()) == Keyword::IF ? NodeKind::IF : NodeKind::WHILE;
+            advance();
+            size_t mark = pending.size();
+            pending.push_back(get_expression());
+            blocks.push_back({kind, mark});
+            continue;
+        }
+        else {
+            done = get_simple_statement();
+        }
+
+        // A finished statement completes the blocks waiting for it.
+        for (;;) {
+            if (blocks.size() == base) {
+                return done;
+            }
+            Block block = blocks.back();
+            if (block.kind == NodeKind::COMPOUND) {
+                if (!opened) {
+                    pending.push_back(done);
+                }
+                opened = false;
+                if (*current().lexeme.start != '}') {
+                    break;
+                }
+                advance();
+            }
+            else {
+                pending.push_back(done);
+            }
+            blocks.pop_back();
+            done = make(block.kind, block.mark);
         }
-        ptr++;
     }
-    else if (tokens[ptr].type == TokenType::KEYWORD) {
-        if (keywords.contains(std::string(tokens[ptr].lexeme.start, tokens[ptr].lexeme.size))) {
-            Keyword current_keyword = keywords.at(std::string(tokens[ptr].lexeme.start, tokens[ptr].lexeme.size));
+}
+
+Node* AST::get_simple_statement() {
+    Node* result = nullptr;
+    size_t mark = pending.size();
+    if (current().type == TokenType::KEYWORD) {
+        if (auto keyword = find_keyword(lexeme())) {
+            Keyword current_keyword = *keyword;
             switch (current_keyword) {
-                case Keyword::IF:
-                    result = new Node("if", TokenType::KEYWORD);
-                    ptr++;
-                    result->children.push_back(get_expression());
-                    result->children.push_back(get_statement());
-                    break;
-                case Keyword::WHILE:
-                    result = new Node("while", TokenType::KEYWORD);
-                    ptr++;
-                    result->children.push_back(get_expression());
-                    result->children.push_back(get_statement());
-                    break;
                 case Keyword::RETURN:
-                    result = new Node("return", TokenType::KEYWORD);
-                    ptr++;
-                    result->children.push_back(get_expression());
-                    if (*tokens[ptr].lexeme.start == ';') {
-                        ptr++;
+                    advance();
+                    pending.push_back(get_expression());
+                    result = make(NodeKind::RETURN, mark);
+                    if (*current().lexeme.start == ';') {
+                        advance();
                     } else {
                         err_code = ErrorCode::STATEMENT_ERROR;
                         raise_syntax_error();
                     }
                     break;
                 case Keyword::IN:
-                    result = new Node("in", TokenType::KEYWORD);
-                    ptr++;
-                    result->children.push_back(get_arguments());
-                    if (*tokens[ptr].lexeme.start == ';') {
-                        ptr++;
+                    advance();
+                    pending.push_back(get_arguments());
+                    result = make(NodeKind::IN, mark);
+                    if (*current().lexeme.start == ';') {
+                        advance();
                     } else {
                         err_code = ErrorCode::STATEMENT_ERROR;
                         raise_syntax_error();
                     }
                     break;
                 case Keyword::OUT:
-                    result = new Node("out", TokenType::KEYWORD);
-                    ptr++;
-                    result->children.push_back(get_expression_list());
-                    if (*tokens[ptr].lexeme.start == ';') {
-                        ptr++;
+                    advance();
+                    pending.push_back(get_expression_list());
+                    result = make(NodeKind::OUT, mark);
+                    if (*current().lexeme.start == ';') {
+                        advance();
                     } else {
                         err_code = ErrorCode::STATEMENT_ERROR;
                         raise_syntax_error();
                     }
                     break;
                 case Keyword::DATA:
-                    ptr++;
+                    advance();
                     result = get_data();
                     break;
-
+                default:
+                    break;
             }
         }
     }
 
     else {
         result = get_expression();
-        if (*tokens[ptr].lexeme.start == ';') {
-            ptr++;
+        if (*current().lexeme.start == ';') {
+            advance();
         } else {
             err_code = ErrorCode::STATEMENT_ERROR;
             raise_syntax_error();
@@ -147,16 +186,17 @@ Node* AST::get_statement() {
 }
 
 Node* AST::get_data() {
-    Node* result = new Node("data", TokenType::KEYWORD);
+    size_t mark = pending.size();
     Node* current_id;
     while (current_id = get_identificator()) {
-        result->children.push_back(current_id);
-        if (*tokens[ptr].lexeme.start == ',') {
-            ptr++;
+        pending.push_back(current_id);
+        if (*current().lexeme.start == ',') {
+            advance();
         }
     }
-    if (*tokens[ptr].lexeme.start == ';') {
-        ptr++;
+    Node* result = make(NodeKind::DATA, mark);
+    if (*current().lexeme.start == ';') {
+        advance();
     } else {
         err_code = ErrorCode::DATA_ERROR;
         raise_syntax_error();
@@ -165,70 +205,226 @@ Node* AST::get_data() {
 }
 
 Node* AST::get_expression_list() {
-    Node* result = new Node("ARG");
+    size_t mark = pending.size();
     Node* first_expr = get_expression();
     if (first_expr) {
-        result->children.push_back(first_expr);
+        pending.push_back(first_expr);
     }
-    while (*tokens[ptr].lexeme.start == ',') {
-        ptr++;
-        result->children.push_back(get_expression());
+    while (*current().lexeme.start == ',') {
+        advance();
+        pending.push_back(get_expression());
     }
-    return result;
+    return make(NodeKind::ARG, mark);
 }
 
-Node* AST::get_expression() {
-    Node* result = nullptr;
-    if (*tokens[ptr].lexeme.start == '-') {
-        result = new Node(std::string(tokens[ptr].lexeme.start, tokens[ptr].lexeme.size), TokenType::OPERATOR);
-        ptr += 1;
-        result->children.push_back(get_expression());
-        return result;
+// Binding power of binary operators, = is right associative and its left side has to be a variable.
+static int precedence(Operator op) {
+    switch (op) {
+        case Operator::ASSIGN:
+            return 1;
+        case Operator::LESS:
+        case Operator::GREATER:
+        case Operator::EQUAL:
+        case Operator::NOT_EQUAL:
+        case Operator::LESS_EQUAL:
+        case Operator::GREATER_EQUAL:
+            return 2;
+        case Operator::ADD:
+        case Operator::SUB:
+            return 3;
+        case Operator::MUL:
+        case Operator::DIV:
+            return 4;
+        default:
+            return 0;
     }
-    if (!(result = get_number())) {
-        if ((result = get_identificator()) || !strncmp(tokens[ptr].lexeme.start, "sqrt", 4)) {
-            if (*tokens[ptr].lexeme.start == '(') {
-                if (!strncmp(tokens[ptr].lexeme.start, "sqrt", 4)) {
-                    result = new Node("sqrt");
+}
+
+// Operators wait on operations while their operands are parsed onto pending (shunting-yard), so neither
+// nesting nor long chains take native stack. An operator is applied once one of no higher precedence
+// follows, or the lowest one if both are = since it is right associative.
+Node* AST::get_expression() {
+    size_t base = operations.size();
+    size_t mark = pending.size();
+    for (;;) {
+        // An operand
+        while (*current().lexeme.start == '-' && current().type == TokenType::OPERATOR) {
+            advance();
+            operations.push_back({Operation::NEGATE, Operator::SUB, nullptr, 0});
+        }
+        if (Node* number = get_number()) {
+            pending.push_back(number);
+        }
+        else if (Node* identifier = get_identificator()) {
+            if (*current().lexeme.start == '(') {
+                advance();
+                operations.push_back({Operation::CALL, Operator::NONE, identifier, pending.size()});
+                if (*current().lexeme.start != ')') {
+                    continue;
+                }
+                advance();
+                close();
+            }
+            else {
+                pending.push_back(identifier);
+            }
+        }
+        else if (*current().lexeme.start == '(') {
+            advance();
+            operations.push_back({Operation::PARENTHESIS, Operator::NONE, nullptr, 0});
+            continue;
+        }
+        else if (operations.size() == base) {
+            return nullptr;
+        }
+        else {
+            err_code = ErrorCode::STATEMENT_ERROR;
+            raise_syntax_error();
+        }
+
+        // What follows the operand: an operator, the end of a parenthesis or an argument, or the end
+        bool next_operand = false;
+        while (!next_operand) {
+            if (current().type == TokenType::OPERATOR) {
+                Operator op = find_operator(lexeme());
+                int op_precedence = precedence(op);
+                if (op_precedence == 0) {
+                    break;
                 }
-                ptr++;
-                result->children.push_back(get_expression_list());
-                if (*tokens[ptr].lexeme.start == ')') {
-                    ptr++;
+                reduce(base, op == Operator::ASSIGN ? op_precedence + 1 : op_precedence);
+                if (op == Operator::ASSIGN && pending.back()->kind != NodeKind::IDENTIFIER) {
+                    err_code = ErrorCode::STATEMENT_ERROR;
+                    raise_syntax_error();
                 }
+                advance();
+                operations.push_back({Operation::BINARY, op, nullptr, 0});
+                next_operand = true;
             }
-            else if (*tokens[ptr].lexeme.start == '=') {
-                Node* tmp = result;
-                result = new Node(std::string(tokens[ptr].lexeme.start, tokens[ptr].lexeme.size), TokenType::OPERATOR);
-                ptr++;
-                result->children.push_back(tmp);
-                result->children.push_back(get_expression());
-                return result;
+            else if (*current().lexeme.start == ')' || *current().lexeme.start == ',') {
+                bool comma = *current().lexeme.start == ',';
+                reduce(base, 0);
+                if (operations.size() == base || (comma && operations.back().kind != Operation::CALL)) {
+                    break;
+                }
+                advance();
+                if (comma) {
+                    next_operand = true;
+                } else if (operations.back().kind == Operation::CALL) {
+                    close();
+                } else {
+                    operations.pop_back();
+                }
             }
+            else {
+                break;
+            }
+        }
+        if (next_operand) {
+            continue;
         }
+
+        // The end, missing closing parentheses are forgiven.
+        while (operations.size() > base) {
+            reduce(base, 0);
+            if (operations.size() > base) {
+                if (operations.back().kind == Operation::CALL) {
+                    close();
+                } else {
+                    operations.pop_back();
+                }
+            }
+        }
+        Node* result = pending[mark];
+        pending.resize(mark);
+        return result;
     }
-    if ( *tokens[ptr].lexeme.start == '(') {
-        ptr++;
-        result = get_expression();
-        if ( *tokens[ptr].lexeme.start == ')') {
-            ptr++;
+}
+
+// Applies the operators on top of the operations that bind at least min_precedence, down to a parenthesis or a call.
+void AST::reduce(size_t base, int min_precedence) {
+    while (operations.size() > base) {
+        Operation operation = operations.back();
+        if (operation.kind == Operation::PARENTHESIS || operation.kind == Operation::CALL ||
+            (operation.kind == Operation::BINARY && precedence(operation.op) < min_precedence)) {
+            return;
         }
+        operations.pop_back();
+        size_t operands = operation.kind == Operation::NEGATE ? 1 : 2;
+        Node* result = make(NodeKind::OPERATOR, pending.size() - operands);
+        result->op = operation.op;
+        pending.push_back(fold(result));
     }
-    if (tokens[ptr].type == TokenType::OPERATOR) {
-        Node* tmp = result;
-        result = new Node(std::string(tokens[ptr].lexeme.start, tokens[ptr].lexeme.size), TokenType::OPERATOR);
-        ptr += 1;
-        result->children.push_back(tmp);
-        result->children.push_back(get_expression());
+}
+
+// Ends the call on top of the operations, its arguments are on pending.
+void AST::close() {
+    Operation call = operations.back();
+    operations.pop_back();
+    Node* arguments = make(NodeKind::ARG, call.mark);
+    size_t mark = pending.size();
+    pending.push_back(arguments);
+    call.callee->kind = NodeKind::CALL;
+    attach(call.callee, mark);
+    pending.push_back(call.callee);
+}
+
+// Replaces an operator on literals by its value, computed on 32-bit ints like the processor does.
+// Division by zero and overflowing division are left for the run time.
+Node* AST::fold(Node* node) {
+    for (Node* child : *node) {
+        if (child->kind != NodeKind::INTEGER_LITERAL) {
+            return node;
+        }
     }
-    return result;
+    auto value = [&](size_t i) { return int32_t((*node)[i]->value); };
+    auto wrap = [](uint32_t result) { return int32_t(result); };
+    int32_t result = 0;
+    if (node->count == 1) {
+        result = wrap(0u - uint32_t(value(0)));
+    } else {
+        int32_t left = value(0);
+        int32_t right = value(1);
+        switch (node->op) {
+            case Operator::ADD:           result = wrap(uint32_t(left) + uint32_t(right)); break;
+            case Operator::SUB:           result = wrap(uint32_t(left) - uint32_t(right)); break;
+            case Operator::MUL:           result = wrap(uint32_t(left) * uint32_t(right)); break;
+            case Operator::DIV:
+                if (right == 0 || (left == INT32_MIN && right == -1)) {
+                    return node;
+                }
+                result = left / right;
+                break;
+            case Operator::LESS:          result = left < right; break;
+            case Operator::GREATER:       result = left > right; break;
+            case Operator::EQUAL:         result = left == right; break;
+            case Operator::NOT_EQUAL:     result = left != right; break;
+            case Operator::LESS_EQUAL:    result = left <= right; break;
+            case Operator::GREATER_EQUAL: result = left >= right; break;
+            default:
+                return node;
+        }
+    }
+    node->kind = NodeKind::INTEGER_LITERAL;
+    node->op = Operator::NONE;
+    node->value = result;
+    node->count = 0;
+    node->children = nullptr;
+    return node;
 }
 
 
 Node* AST::get_number() {
-    if (tokens[ptr].type == TokenType::INTEGER_LITERAL) {
-        Node * result = new Node(std::string(tokens[ptr].lexeme.start, tokens[ptr].lexeme.size), TokenType::INTEGER_LITERAL);
-        ptr++;
+    if (current().type == TokenType::INTEGER_LITERAL) {
+        Node * result = make(NodeKind::INTEGER_LITERAL, pending.size());
+        result->value = strtoll(std::string(lexeme()).c_str(), nullptr, 10);
+        // Cells are 32-bit, a wider literal would be wrapped by fold or the processor. 2147483648 is only
+        // allowed right after a unary minus, as -2147483648.
+        bool negated = !operations.empty() && operations.back().kind == Operation::NEGATE;
+        if (result->value > (negated ? 1LL << 31 : INT32_MAX)) {
+            fprintf(stderr, "FAIL literal %.*s does not fit in 32 bits\n", int(lexeme().size()), lexeme().data());
+            exit(1);
+        }
+        advance();
         return result;
     }
     else {
@@ -236,12 +432,46 @@ Node* AST::get_number() {
     }
 }
 
+Node* AST::make(NodeKind kind, size_t mark) {
+    Node* node = arena.make(Node{kind, Operator::NONE, Interner::NO_SYMBOL, 0, 0, 0, nullptr, 0});
+    ++node_count;
+    attach(node, mark);
+    return node;
+}
+
+void AST::attach(Node* node, size_t mark) {
+    node->count = pending.size() - mark;
+    node->children = node->count ? arena.array(pending.data() + mark, node->count) : nullptr;
+    pending.resize(mark);
+}
+
+std::string_view AST::lexeme() {
+    return {current().lexeme.start, current().lexeme.size};
+}
+
+const Token& AST::current() {
+    return lexer.peek();
+}
+
+void AST::advance() {
+    lexer.next();
+    ptr++;
+}
+
 Node *AST::get_root() const {
     return this->root;
 }
 
+const Interner& AST::get_names() const {
+    return names;
+}
+
+size_t AST::get_node_count() const {
+    return node_count;
+}
+
 void AST::raise_syntax_error() {
-    printf(ANSI_COLOR_RED "Syntax Error at position %d, lexeme \'%.*s\'.\n" ANSI_COLOR_RESET, ptr, tokens[ptr].lexeme.size, tokens[ptr].lexeme.start);
+    printf(ANSI_COLOR_RED "Syntax Error at position %d, lexeme \'%.*s\'.\n" ANSI_COLOR_RESET, ptr, current().lexeme.size, current().lexeme.start);
     ERROR_INFO();
     exit(1);
 }
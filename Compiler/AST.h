@@ -6,21 +6,36 @@
 #define LANG_AST_H
 
 #include "common.h"
+#include "Lexer.h"
 
 class AST {
 public:
-    explicit AST(const std::vector<Token>& tokens,  const std::map<std::string, Keyword>& keywords);
+    explicit AST(Lexer& lexer);
     Node* get_root() const;
+    const Interner& get_names() const;
+    size_t get_node_count() const;
 private:
     Node* get_identificator();
     Node* get_arguments();
     Node* get_function();
     Node* get_statement();
+    Node* get_simple_statement();
     Node* get_data();
     Node* get_expression_list();
     Node* get_expression();
+    void reduce(size_t base, int min_precedence);
+    void close();
+    Node* fold(Node* node);
     Node* get_number();
 
+    const Token& current();
+    void advance();
+
+    // Children are collected on pending and copied to the arena once the node is complete.
+    Node* make(NodeKind kind, size_t mark);
+    void attach(Node* node, size_t mark);
+    std::string_view lexeme();
+
 
 
     void raise_syntax_error();
@@ -29,9 +44,28 @@ private:
 
     int ptr;
     Node* root;
+    size_t node_count;
     ErrorCode err_code;
-    const std::map<std::string, Keyword>& keywords;
-    const std::vector<Token>& tokens;
+    Lexer& lexer;
+    Arena arena;
+    Interner names;
+    std::vector<Node*> pending;
+
+    // Statement waiting for the statements of its body, children from mark on pending are already parsed.
+    struct Block {
+        NodeKind kind;
+        size_t   mark;
+    };
+    std::vector<Block> blocks;
+
+    // Operator or bracket waiting for its operands.
+    struct Operation {
+        enum Kind : uint8_t { BINARY, NEGATE, PARENTHESIS, CALL } kind;
+        Operator op;
+        Node*    callee;   // CALL, its arguments start at mark on pending
+        size_t   mark;
+    };
+    std::vector<Operation> operations;
 };
 
 
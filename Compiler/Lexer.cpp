@@ -1,51 +1,77 @@
 #include "Lexer.h"
 
-Lexer::Lexer(std::string text, const std::map<std::string, Keyword>& keywords) : text(std::move(text)), keywords(keywords) {}
+Lexer::Lexer(std::string_view text) : text(text), i(0), in_word(false), word_size(0), current_word_start(text.data()),
+                                      finished(false), queue(), read(0), written(0) {}
 
-std::vector<Token> Lexer::separate_tokens() {
-    bool in_word = false;
-    size_t word_size = 0;
-    const char* current_word_start = text.data();
-    for (size_t i = 0; i < text.size(); ++i) {
-        if (!in_word && isspace(text[i])) {
-            current_word_start++;
+const Token& Lexer::peek() {
+    while (read == written) {
+        if (finished) {
+            // Repeat the end of the text.
+            push(queue[(read - 1) % 4]);
+        } else {
+            step();
         }
-        else if (('a' <= text[i] && text[i] <= 'z') || ('0' <= text[i] && text[i] <= '9') || (text[i] == '_')) {
-            in_word = true;
-            word_size++;
-        }
-        else if (is_separator(text[i])) {
-            if (in_word) {
-                load_word(current_word_start, word_size, in_word);
-            }
-            tokens.push_back(Token{{current_word_start++, 1}, TokenType::SEPARATOR});
+    }
+    return queue[read % 4];
+}
+
+Token Lexer::next() {
+    Token token = peek();
+    ++read;
+    return token;
+}
+
+void Lexer::push(const Token& token) {
+    queue[written++ % 4] = token;
+}
 
+// Handles one character, or finishes the text with its last word and a NULL_TYPE token.
+void Lexer::step() {
+    if (i == text.size()) {
+        if (in_word) {
+            load_word(current_word_start, word_size, in_word);
+        }
+        if (current_word_start == text.data() + text.size()) {
+            // The text does not end with \0, the parser gets an empty string to look at instead.
+            push(Token{{"", 0}, TokenType::NULL_TYPE});
+        } else {
+            load_word(current_word_start, word_size, in_word);
         }
-        else if (is_compound(&text[i])) {
-            if (in_word) {
-                load_word(current_word_start, word_size, in_word);
-            }
-            tokens.push_back(Token{{current_word_start, 2}, TokenType::OPERATOR});
-            current_word_start += 2;
-            ++i;
+        finished = true;
+        return;
+    }
+    if (!in_word && isspace(text[i])) {
+        current_word_start++;
+    }
+    else if (('a' <= text[i] && text[i] <= 'z') || ('0' <= text[i] && text[i] <= '9') || (text[i] == '_')) {
+        in_word = true;
+        word_size++;
+    }
+    else if (is_separator(text[i])) {
+        if (in_word) {
+            load_word(current_word_start, word_size, in_word);
         }
-        else if (is_operator(text[i])) {
-            if (in_word) {
-                load_word(current_word_start, word_size, in_word);
-            }
-            tokens.push_back(Token{{current_word_start++, 1}, TokenType::OPERATOR});
+        push(Token{{current_word_start++, 1}, TokenType::SEPARATOR});
+
+    }
+    else if (is_compound(i)) {
+        if (in_word) {
+            load_word(current_word_start, word_size, in_word);
         }
-        else if (in_word && isspace(text[i])) {
-            load_word(current_word_start, word_size, in_word, 1);
+        push(Token{{current_word_start, 2}, TokenType::OPERATOR});
+        current_word_start += 2;
+        ++i;
+    }
+    else if (is_operator(text[i])) {
+        if (in_word) {
+            load_word(current_word_start, word_size, in_word);
         }
+        push(Token{{current_word_start++, 1}, TokenType::OPERATOR});
     }
-
-    // This part adds last word and NULL_TYPE to the end of token vector
-    if (in_word) {
-        load_word(current_word_start, word_size, in_word);
+    else if (in_word && isspace(text[i])) {
+        load_word(current_word_start, word_size, in_word, 1);
     }
-    load_word(current_word_start, word_size, in_word);
-    return tokens;
+    ++i;
 }
 
 bool Lexer::is_separator(char c) {
@@ -56,14 +82,16 @@ bool Lexer::is_operator(char c) {
     return c == '+' || c == '*' || c == '/' || c == '-' || c == '=' || c == '>' || c == '<';
 }
 
-bool Lexer::is_compound(const char *c) {
-    return (((*c == '!') && (*(c + 1) == '=')) || ((*c == '=') && (*(c + 1) == '=')) || ((*c == '<') && (*(c + 1) == '=')) ||
-            ((*c == '>') && (*(c + 1) == '=')));
+bool Lexer::is_compound(size_t i) const {
+    if (i + 1 >= text.size() || text[i + 1] != '=') {
+        return false;
+    }
+    return text[i] == '!' || text[i] == '=' || text[i] == '<' || text[i] == '>';
 }
 
 TokenType Lexer::classify_word(const char *start, size_t size) {
     TokenType type = TokenType::NULL_TYPE;
-    if (keywords.contains(std::string(start, size))) {
+    if (find_keyword({start, size})) {
         type = TokenType::KEYWORD;
     }
     else {
@@ -88,7 +116,7 @@ TokenType Lexer::classify_word(const char *start, size_t size) {
 
 void Lexer::load_word(const char *&start, size_t &size, bool &status, int shift) {
     auto type = classify_word(start, size);
-    tokens.push_back(Token{{start, size}, type});
+    push(Token{{start, size}, type});
     start += size + shift;
     size = 0;
     status = false;
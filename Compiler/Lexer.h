@@ -11,20 +11,36 @@
 #include <map>
 #include "common.h"
 
+// Splits the text into tokens on demand, a token points into the text, so it has to outlive the tokens.
+// The text is not expected to end with \0.
+// The last token has NULL_TYPE, once the text ends peek() and next() keep returning it.
 class Lexer {
 public:
-    explicit            Lexer(std::string  text, const std::map<std::string, Keyword>& keywords);
-    std::vector<Token>  separate_tokens();
+    explicit            Lexer(std::string_view text);
+    const Token&        peek();
+    Token               next();
+    // Tokens taken by next() so far.
+    size_t              get_token_count() const { return read; }
 private:
     TokenType   classify_word(const char* start, size_t size);
     void        load_word(const char*& start, size_t& size, bool& status, int shift = 0);
+    void        push(const Token& token);
+    void        step();
     static bool is_separator(char c);
     static bool is_operator(char c);
-    static bool is_compound(const char* c);
+    bool        is_compound(size_t i) const;
 
-    std::string text;
-    const std::map<std::string, Keyword>& keywords;
-    std::vector<Token> tokens;
+    std::string_view text;
+    // State of the scan between tokens.
+    size_t      i;
+    bool        in_word;
+    size_t      word_size;
+    const char* current_word_start;
+    bool        finished;
+    // A character completes at most two tokens (a word and the separator after it).
+    Token       queue[4];
+    size_t      read;
+    size_t      written;
 };
 
 
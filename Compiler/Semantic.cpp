@@ -1,101 +1,101 @@
 #include "Semantic.h"
 
-std::map<std::string, std::map<std::string, int>> Semantic::create_symbol_table() {
-    int f_cnt = 0;
-    int data_index = -1;
-    // Create all functions
-    for (size_t i = 0; i < root->children.size(); ++i) {
-        if (root->children[i]->type == TokenType::KEYWORD) {
-            data_index = i;
+// Only the children of the root, so that every body knows the globals and the functions defined after it.
+void Semantic::collect_globals() {
+    is_function.assign(names.size(), false);
+    for (Node* i : *root) {
+        if (i->kind == NodeKind::DATA) {
+            data = i;
             continue;
         }
-        TABLE[root->children[i]->data];
-    }
-
-    // Create standard functions
-    TABLE["sqrt"];
-    TABLE["sqr"];
-    if (data_index != -1) {
-        global_var = root->children[data_index]->children.size();
-        for (size_t i = 0; i < root->children[data_index]->children.size(); ++i) {
-            for (size_t j = 0; j < root->children.size(); ++j) {
-                if (j == data_index) {
-                    continue;
-                }
-                TABLE[root->children[j]->data][root->children[data_index]->children[i]->data] = i;
-            }
-        }
-    }
-    for (size_t i = 0; i < root->children.size(); ++i) {
-        if (i == data_index) {
-            continue;
-        }
-        for (size_t j = 0; j < root->children[i]->children[0]->children.size(); ++j) {
-            TABLE[root->children[i]->data][root->children[i]->children[0]->children[j]->data] = TABLE[root->children[i]->data].size();
+        is_function[i->symbol] = true;
+        if (names.name(i->symbol) == "main") {
+            table.main = i->symbol;
         }
     }
-    for (size_t i = 0; i < root->children.size(); ++i) {
-        if (i == data_index) {
-            continue;
+
+    // Standard functions
+    for (std::string_view standard : {"sqrt", "sqr"}) {
+        if (uint32_t symbol = names.find(standard); symbol != Interner::NO_SYMBOL) {
+            is_function[symbol] = true;
         }
-        add_local_vars(root->children[i], root->children[i]->data);
     }
-    for (size_t i = 0; i < root->children.size(); ++i) {
-        if (i == data_index) {
-            continue;
-        }
-        if (TABLE[root->children[i]->data].size() > max_var) {
-            max_var = TABLE[root->children[i]->data].size();
-        }
+    if (data) {
+        table.global_var = data->count;
     }
-    return TABLE;
 }
 
-void Semantic::add_local_vars(Node* node, const std::string& func) {
-    if (node->type == TokenType::KEYWORD) {
-        if (keywords.at(node->data) == Keyword::DATA) {
-            for (auto& i : node->children) {
-                TABLE[func][i->data] = TABLE[func].size();
-            }
-            return;
+// Globals come first in every function, then its arguments and its data. A body is walked once:
+// data declares, variables are only collected, since data may come after their use.
+void Semantic::analyse_function(Node* function) {
+    Scope scope;
+    if (data) {
+        for (size_t i = 0; i < data->count; ++i) {
+            scope.set((*data)[i]->symbol, i);
         }
     }
-    for (auto& i : node->children) {
-        add_local_vars(i, func);
+    for (Node* arg : *(*function)[0]) {
+        scope.set(arg->symbol, scope.size());
+    }
+    uses.clear();
+    visit((*function)[1], scope);
+    for (Node* use : uses) {
+        resolve(use, scope);
     }
+    table.max_var = std::max(table.max_var, scope.size());
 }
 
-void Semantic::name_validation_initial() {
-    if (!TABLE.contains("main")) {
-        printf("No entry point!");
-        return;
-    }
-    for (auto& i : root->children) {
-        if (i->data == "data") {
+void Semantic::visit(Node* body, Scope& scope) {
+    work.assign(1, body);
+    while (!work.empty()) {
+        Node* node = work.back();
+        work.pop_back();
+        if (!node) {
             continue;
         }
-        name_validation(i->children[1], i->data);
+        switch (node->kind) {
+            case NodeKind::DATA:
+                for (Node* i : *node) {
+                    scope.set(i->symbol, scope.size());
+                }
+                break;
+            case NodeKind::IDENTIFIER:
+                uses.push_back(node);
+                break;
+            default:
+                // Reversed, so that children are taken in order.
+                for (size_t i = node->count; i-- > 0;) {
+                    work.push_back((*node)[i]);
+                }
+        }
     }
 }
 
-void Semantic::name_validation(Node* node, const std::string& func) {
-    if (node->type == TokenType::IDENTIFICATOR) {
-        if (!TABLE.contains(node->data) && !TABLE[func].contains(node->data)) {
-            printf("FAIL no such name: %s\n", node->data.c_str());
+// Every variable gets its register here, an unknown name is reported and takes r0.
+void Semantic::resolve(Node* use, const Scope& scope) {
+    use->slot = scope.find(use->symbol);
+    // Calls of functions that are not defined here are imports resolved by the linker.
+    if (use->slot < 0) {
+        use->slot = 0;
+        if (!is_function[use->symbol]) {
+            fprintf(stderr, "FAIL no such name: %.*s\n", int(names.name(use->symbol).size()),
+                    names.name(use->symbol).data());
             // RAISE SEMANTIC ERROR
         }
     }
-    for (auto& i : node->children) {
-        name_validation(i, func);
-    }
 }
 
-Semantic::Semantic(Node *root, const std::map<std::string, Keyword> &keywords) : root(root), keywords(keywords), global_var(0), max_var(0) {
-    create_symbol_table();
-    name_validation_initial();
+// A module without main is linked into a program that has one.
+Semantic::Semantic(Node *root, const Interner& names) : root(root), names(names), table{0, 0, Interner::NO_SYMBOL}, data(nullptr) {
+    collect_globals();
+    for (Node* function : *root) {
+        if (function->kind == NodeKind::FUNCTION) {
+            analyse_function(function);
+        }
+    }
 }
 
-SYMBOL_TABLE Semantic::get_symbol_table() {
-    return {TABLE, global_var, max_var};
+const SYMBOL_TABLE& Semantic::get_symbol_table() const {
+    return table;
 }
 
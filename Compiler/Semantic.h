@@ -5,19 +5,21 @@
 
 class Semantic {
 public:
-    explicit Semantic(Node* root, const std::map<std::string, Keyword>& keyword);
-    SYMBOL_TABLE get_symbol_table();
+    Semantic(Node* root, const Interner& names);
+    const SYMBOL_TABLE& get_symbol_table() const;
 private:
     Node* root;
-    int global_var;
-    int max_var;
-    std::map<std::string, std::map<std::string, int>> TABLE;
-    const std::map<std::string, Keyword>& keywords;
+    const Interner& names;
+    SYMBOL_TABLE table;
+    Node* data;                         // globals
+    std::vector<char> is_function;      // by symbol, functions defined here and the standard ones
+    std::vector<Node*> uses;            // variables of the current function
+    std::vector<Node*> work;            // nodes left to visit
 
-    std::map<std::string, std::map<std::string, int>> create_symbol_table();
-    void add_local_vars(Node* node, const std::string& func);
-    void name_validation_initial();
-    void name_validation(Node* node, const std::string& func);
+    void collect_globals();
+    void analyse_function(Node* function);
+    void visit(Node* body, Scope& scope);
+    void resolve(Node* use, const Scope& scope);
 };
 
 
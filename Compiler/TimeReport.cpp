@@ -0,0 +1,159 @@
+#include "TimeReport.h"
+
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+// Every allocation of the compiler goes through here, so a phase's share is the difference of the counters.
+static size_t allocation_count = 0;
+static size_t allocation_bytes = 0;
+
+void* operator new(size_t size) {
+    ++allocation_count;
+    allocation_bytes += size;
+    if (void* result = malloc(size ? size : 1)) {
+        return result;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* pointer) noexcept {
+    free(pointer);
+}
+
+void operator delete(void* pointer, size_t) noexcept {
+    free(pointer);
+}
+
+// VmHWM of /proc/self/status, the peak of the process if there is no /proc.
+static long peak_rss_kb() {
+    char status[4096];
+    int input = open("/proc/self/status", O_RDONLY);
+    ssize_t size = input < 0 ? -1 : read(input, status, sizeof(status) - 1);
+    if (input >= 0) {
+        close(input);
+    }
+    if (size > 0) {
+        status[size] = '\0';
+        if (const char* line = strstr(status, "VmHWM:")) {
+            return atol(line + strlen("VmHWM:"));
+        }
+    }
+    rusage usage = {};
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+// Since Linux 4.0 writing 5 to clear_refs sets VmHWM back to the current RSS.
+static void reset_peak_rss() {
+    int output = open("/proc/self/clear_refs", O_WRONLY);
+    if (output >= 0) {
+        write(output, "5", 1);
+        close(output);
+    }
+}
+
+static long children_rss_kb() {
+    rusage usage = {};
+    getrusage(RUSAGE_CHILDREN, &usage);
+    return usage.ru_maxrss;
+}
+
+TimeReport::TimeReport(Format format) : format(format), start_allocations(0), start_bytes(0),
+                                        start_children_rss_kb(0) {}
+
+TimeReport::~TimeReport() {
+    if (format == Format::TEXT) {
+        print_text();
+    } else if (format == Format::JSON) {
+        print_json();
+    }
+}
+
+void TimeReport::begin(const char* phase) {
+    if (format == Format::NONE) {
+        return;
+    }
+    phases.push_back({phase, 0, 0, 0, 0, false, 0, {}});
+    reset_peak_rss();
+    start_children_rss_kb = children_rss_kb();
+    start_allocations = allocation_count;
+    start_bytes = allocation_bytes;
+    start = std::chrono::steady_clock::now();
+}
+
+void TimeReport::end() {
+    if (format == Format::NONE) {
+        return;
+    }
+    std::chrono::duration<double, std::milli> wall = std::chrono::steady_clock::now() - start;
+    Phase& phase = phases.back();
+    phase.wall_ms = wall.count();
+    phase.allocations = allocation_count - start_allocations;
+    phase.allocated_bytes = allocation_bytes - start_bytes;
+    phase.peak_rss_kb = peak_rss_kb();
+    // Processes run by the phase (dot) are measured apart, ru_maxrss of the children only grows. It is only
+    // an upper bound of the child's own peak: exec keeps the high-water mark of the memory it replaces, and
+    // system() runs the child on the memory of xzyc until then.
+    long children = children_rss_kb();
+    if (children > start_children_rss_kb) {
+        phase.counts.emplace_back("child_peak_rss_upper_bound_kb", children);
+    }
+}
+
+void TimeReport::count(const char* name, size_t value) {
+    if (format == Format::NONE) {
+        return;
+    }
+    phases.back().counts.emplace_back(name, value);
+}
+
+void TimeReport::fail(int status) {
+    if (format == Format::NONE) {
+        return;
+    }
+    phases.back().failed = true;
+    phases.back().status = status;
+}
+
+void TimeReport::print_text() const {
+    Phase total = {"total", 0, 0, 0, 0, false, 0, {}};
+    fprintf(stderr, "%-10s %10s %12s %12s %16s  %s\n", "phase", "wall ms", "peak RSS KB", "allocations",
+            "allocated bytes", "counts");
+    for (const Phase& phase : phases) {
+        fprintf(stderr, "%-10s %10.3f %12ld %12zu %16zu", phase.name, phase.wall_ms, phase.peak_rss_kb,
+                phase.allocations, phase.allocated_bytes);
+        for (size_t i = 0; i < phase.counts.size(); ++i) {
+            fprintf(stderr, "%s%s %zu", i ? ", " : "  ", phase.counts[i].first, phase.counts[i].second);
+        }
+        if (phase.failed) {
+            fprintf(stderr, "%sFAILED with status %d", phase.counts.empty() ? "  " : ", ", phase.status);
+        }
+        fprintf(stderr, "\n");
+        total.wall_ms += phase.wall_ms;
+        total.peak_rss_kb = std::max(total.peak_rss_kb, phase.peak_rss_kb);
+        total.allocations += phase.allocations;
+        total.allocated_bytes += phase.allocated_bytes;
+    }
+    fprintf(stderr, "%-10s %10.3f %12ld %12zu %16zu\n", total.name, total.wall_ms, total.peak_rss_kb,
+            total.allocations, total.allocated_bytes);
+}
+
+// Names of phases and counts are identifiers, they need no escaping.
+void TimeReport::print_json() const {
+    fprintf(stderr, "{\"phases\": [");
+    for (size_t i = 0; i < phases.size(); ++i) {
+        const Phase& phase = phases[i];
+        fprintf(stderr, "%s\n  {\"name\": \"%s\", \"wall_ms\": %.3f, \"peak_rss_kb\": %ld, \"allocations\": %zu, "
+                        "\"allocated_bytes\": %zu", i ? "," : "", phase.name, phase.wall_ms, phase.peak_rss_kb,
+                phase.allocations, phase.allocated_bytes);
+        for (auto& [name, value] : phase.counts) {
+            fprintf(stderr, ", \"%s\": %zu", name, value);
+        }
+        if (phase.failed) {
+            fprintf(stderr, ", \"failed\": true, \"status\": %d", phase.status);
+        }
+        fprintf(stderr, "}");
+    }
+    fprintf(stderr, "\n]}\n");
+}
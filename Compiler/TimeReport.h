@@ -0,0 +1,48 @@
+#ifndef LANG_TIMEREPORT_H
+#define LANG_TIMEREPORT_H
+
+#include "common.h"
+
+#include <chrono>
+
+// What every phase of a compilation took, printed to stderr by --time-report.
+class TimeReport {
+public:
+    enum class Format { NONE, TEXT, JSON };
+
+    explicit TimeReport(Format format);
+    ~TimeReport();
+
+    // Starts the phase, the peak RSS is reset to the current RSS where the kernel allows it.
+    void begin(const char* phase);
+    void end();
+    // Adds a count (tokens, nodes...) to the phase that ended last.
+    void count(const char* name, size_t value);
+    // Marks the phase that ended last as failed, e.g. dot that could not be run.
+    void fail(int status);
+
+private:
+    struct Phase {
+        const char* name;
+        double      wall_ms;
+        long        peak_rss_kb;
+        size_t      allocations;
+        size_t      allocated_bytes;
+        bool        failed;
+        int         status;
+        std::vector<std::pair<const char*, size_t>> counts;
+    };
+
+    Format format;
+    std::vector<Phase> phases;
+    std::chrono::steady_clock::time_point start;
+    size_t start_allocations;
+    size_t start_bytes;
+    long start_children_rss_kb;
+
+    void print_text() const;
+    void print_json() const;
+};
+
+
+#endif //LANG_TIMEREPORT_H
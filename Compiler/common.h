@@ -10,6 +10,12 @@
 #include <map>
 #include <string>
 #include <string_view>
+#include <array>
+#include <optional>
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+#include <algorithm>
 #include <fstream>
 #include <sstream>
 
@@ -46,6 +52,42 @@ enum class Keyword {
     OUT     = 5
 };
 
+constexpr std::array<std::string_view, 6> KEYWORDS = {"return", "if", "while", "data", "in", "out"};
+
+// (first + last character) % 16 tells the keywords apart, the table is built and checked at compile time.
+constexpr size_t keyword_slot(std::string_view word) {
+    return (uint8_t(word.front()) + uint8_t(word.back())) % 16;
+}
+
+constexpr std::array<int, 16> KEYWORD_SLOTS = [] {
+    std::array<int, 16> slots{};
+    slots.fill(-1);
+    for (size_t i = 0; i < KEYWORDS.size(); ++i) {
+        slots[keyword_slot(KEYWORDS[i])] = int(i);
+    }
+    return slots;
+}();
+
+static_assert([] {
+    for (size_t i = 0; i < KEYWORDS.size(); ++i) {
+        if (KEYWORD_SLOTS[keyword_slot(KEYWORDS[i])] != int(i)) {
+            return false;
+        }
+    }
+    return true;
+}(), "keyword_slot is not a perfect hash of KEYWORDS");
+
+constexpr std::optional<Keyword> find_keyword(std::string_view word) {
+    if (word.empty()) {
+        return std::nullopt;
+    }
+    int index = KEYWORD_SLOTS[keyword_slot(word)];
+    if (index < 0 || KEYWORDS[index] != word) {
+        return std::nullopt;
+    }
+    return Keyword(index);
+}
+
 
 struct Lexeme {
     const char * start;
@@ -57,20 +99,206 @@ struct Token {
     TokenType type;
 };
 
+enum class NodeKind : uint8_t {
+    ROOT,
+    DATA,
+    FUNCTION,
+    ARG,
+    COMPOUND,
+    IF,
+    WHILE,
+    RETURN,
+    IN,
+    OUT,
+    OPERATOR,
+    INTEGER_LITERAL,
+    IDENTIFIER,   // variable
+    CALL          // its only child is the ARG of the arguments
+};
+
+enum class Operator : uint8_t {
+    NONE,
+    ADD,
+    SUB,
+    MUL,
+    DIV,
+    ASSIGN,
+    LESS,
+    GREATER,
+    EQUAL,
+    NOT_EQUAL,
+    LESS_EQUAL,
+    GREATER_EQUAL
+};
+
+constexpr std::array<std::string_view, 12> OPERATOR_TEXT = {"", "+", "-", "*", "/", "=", "<", ">", "==", "!=", "<=", ">="};
+
+constexpr Operator find_operator(std::string_view text) {
+    for (size_t i = 1; i < OPERATOR_TEXT.size(); ++i) {
+        if (OPERATOR_TEXT[i] == text) {
+            return Operator(i);
+        }
+    }
+    return Operator::NONE;
+}
+
+// Bump allocator, everything allocated from it is freed at once with the arena.
+class Arena {
+public:
+    Arena() = default;
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    void* allocate(size_t size, size_t align) {
+        size_t shift = (align - uintptr_t(free) % align) % align;
+        if (shift + size > left) {
+            size_t block = std::max(BLOCK_SIZE, size + align);
+            blocks.emplace_back(new char[block]);
+            free = blocks.back().get();
+            left = block;
+            shift = (align - uintptr_t(free) % align) % align;
+        }
+        void* result = free + shift;
+        free += shift + size;
+        left -= shift + size;
+        return result;
+    }
+
+    template <typename T>
+    T* make(const T& value) {
+        return new (allocate(sizeof(T), alignof(T))) T(value);
+    }
+
+    template <typename T>
+    T* array(const T* values, size_t count) {
+        T* result = (T*) allocate(sizeof(T) * count, alignof(T));
+        std::copy(values, values + count, result);
+        return result;
+    }
+
+    size_t allocated() const { return blocks.size() * BLOCK_SIZE; }
+
+private:
+    static constexpr size_t BLOCK_SIZE = 1 << 16;
+    std::vector<std::unique_ptr<char[]>> blocks;
+    char* free = nullptr;
+    size_t left = 0;
+};
+
+// Names to dense 32-bit ids. The names are views, their text has to outlive the interner.
+class Interner {
+public:
+    uint32_t intern(std::string_view name) {
+        auto [it, inserted] = ids.try_emplace(name, uint32_t(names.size()));
+        if (inserted) {
+            names.push_back(name);
+        }
+        return it->second;
+    }
+
+    // Id of a name that was interned, or NO_SYMBOL.
+    uint32_t find(std::string_view name) const {
+        auto it = ids.find(name);
+        return it == ids.end() ? NO_SYMBOL : it->second;
+    }
+
+    std::string_view name(uint32_t id) const { return names[id]; }
+
+    size_t size() const { return names.size(); }
+
+    static constexpr uint32_t NO_SYMBOL = UINT32_MAX;
+
+private:
+    std::unordered_map<std::string_view, uint32_t> ids;
+    std::vector<std::string_view> names;
+};
+
+// Nodes live in the Arena of their tree, children are a contiguous array of pointers.
 struct Node {
-    std::vector<Node*> children;
-    std::string data;
-    int num;
-    TokenType type;
-    Node() = default;
+    NodeKind  kind;
+    Operator  op;           // OPERATOR
+    uint32_t  symbol;       // IDENTIFIER, CALL and FUNCTION
+    int64_t   value;        // INTEGER_LITERAL
+    uint32_t  count;
+    int32_t   slot;         // IDENTIFIER: register of the variable, resolved by Semantic
+    Node**    children;
+    int       num;
+
+    Node* const* begin() const { return children; }
+    Node* const* end() const { return children + count; }
+    Node* operator[](size_t i) const { return children[i]; }
+};
+
+// Text of the node as it is shown in the dot image and the dump.
+inline std::string node_text(const Node* node, const Interner& names) {
+    switch (node->kind) {
+        case NodeKind::ROOT:            return "ROOT";
+        case NodeKind::DATA:            return "data";
+        case NodeKind::ARG:             return "ARG";
+        case NodeKind::COMPOUND:        return "COMPOUND";
+        case NodeKind::IF:              return "if";
+        case NodeKind::WHILE:           return "while";
+        case NodeKind::RETURN:          return "return";
+        case NodeKind::IN:              return "in";
+        case NodeKind::OUT:             return "out";
+        case NodeKind::OPERATOR:        return std::string(OPERATOR_TEXT[int(node->op)]);
+        case NodeKind::INTEGER_LITERAL: return std::to_string(node->value);
+        default:                        return std::string(names.name(node->symbol));
+    }
+}
+
+// Variables of a function by symbol id, open addressing with linear probing.
+class Scope {
+public:
+    Scope() : cells(8, {Interner::NO_SYMBOL, 0}), used(0) {}
+
+    // Slot of the variable, -1 if it is not declared.
+    int find(uint32_t symbol) const {
+        for (size_t i = symbol & (cells.size() - 1); ; i = (i + 1) & (cells.size() - 1)) {
+            if (cells[i].symbol == symbol) {
+                return cells[i].slot;
+            }
+            if (cells[i].symbol == Interner::NO_SYMBOL) {
+                return -1;
+            }
+        }
+    }
+
+    // Declares the variable, a variable declared again only gets the new slot.
+    void set(uint32_t symbol, int slot) {
+        if (2 * (used + 1) > cells.size()) {
+            std::vector<Cell> old(cells.size() * 2, {Interner::NO_SYMBOL, 0});
+            old.swap(cells);
+            used = 0;
+            for (Cell& cell : old) {
+                if (cell.symbol != Interner::NO_SYMBOL) {
+                    set(cell.symbol, cell.slot);
+                }
+            }
+        }
+        size_t i = symbol & (cells.size() - 1);
+        while (cells[i].symbol != Interner::NO_SYMBOL && cells[i].symbol != symbol) {
+            i = (i + 1) & (cells.size() - 1);
+        }
+        used += cells[i].symbol == Interner::NO_SYMBOL;
+        cells[i] = {symbol, slot};
+    }
+
+    int size() const { return int(used); }
 
-    explicit Node(std::string s, TokenType type = TokenType::NULL_TYPE) : data(std::move(s)), children(), num(0), type(type) {}
+private:
+    struct Cell {
+        uint32_t symbol;
+        int      slot;
+    };
+    std::vector<Cell> cells;
+    size_t used;
 };
 
 struct SYMBOL_TABLE {
-    std::map<std::string, std::map<std::string, int>> TABLE;
     int global_var;
     int max_var;
+    uint32_t main;      // NO_SYMBOL in a module without main
 };
 
 #endif //LANG_COMMON_H
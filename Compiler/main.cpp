@@ -1,162 +1,292 @@
 #include "common.h"
 
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
 #include "Lexer.cpp"
 #include "AST.cpp"
 #include "Semantic.cpp"
 #include "ASMTranslator.cpp"
+#include "TimeReport.cpp"
 
 
-void DFS_print(Node *node, FILE *file) {
-    if (!node) {
-        return;
-    }
-    if (*node->data.c_str() == '<' || *node->data.c_str()) {
-        fprintf(file, "\tNode%d [label=\"{<f0> 0x%08x |{\\%s}}\"];\n", node->num, node, node->data.c_str());
-    } else {
-        fprintf(file, "\tNode%d [label=\"{<f0> 0x%08x |{%s}}\"];\n", node->num, node, node->data.c_str());
-    }
-    for (auto &i : node->children) {
-        fprintf(file, "\tNode%d -> Node%d:f0;\n", node->num, i->num);
-    }
-    for (auto &i : node->children) {
-        DFS_print(i, file);
+// Nodes in the order of a depth-first walk, the tree may be too deep for recursion.
+std::vector<Node *> preorder(Node *root) {
+    std::vector<Node *> order;
+    std::vector<Node *> work = {root};
+    while (!work.empty()) {
+        Node *node = work.back();
+        work.pop_back();
+        if (!node) {
+            continue;
+        }
+        order.push_back(node);
+        for (size_t i = node->count; i-- > 0;) {
+            work.push_back((*node)[i]);
+        }
     }
+    return order;
 }
 
 
-void enumerate(Node *node, int &cnt) {
-    if (!node) {
-        return;
-    }
-    node->num = cnt++;
-    for (auto &i : node->children) {
-        enumerate(i, cnt);
+void DFS_print(const std::vector<Node *> &nodes, const Interner &names, FILE *file) {
+    for (Node *node : nodes) {
+        std::string data = node_text(node, names);
+        if (*data.c_str() == '<' || *data.c_str()) {
+            fprintf(file, "\tNode%d [label=\"{<f0> 0x%08x |{\\%s}}\"];\n", node->num, node, data.c_str());
+        } else {
+            fprintf(file, "\tNode%d [label=\"{<f0> 0x%08x |{%s}}\"];\n", node->num, node, data.c_str());
+        }
+        for (Node *i : *node) {
+            if (i) {
+                fprintf(file, "\tNode%d -> Node%d:f0;\n", node->num, i->num);
+            }
+        }
     }
 }
 
-void print_dot(const char *file_name, Node *root) {
+
+void enumerate(const std::vector<Node *> &nodes) {
     int cnt = 0;
-    enumerate(root, cnt);
+    for (Node *node : nodes) {
+        node->num = cnt++;
+    }
+}
+
+void print_dot(const char *file_name, Node *root, const Interner &names) {
+    std::vector<Node *> nodes = preorder(root);
+    enumerate(nodes);
     FILE *dot_output = fopen(file_name, "w");
     fprintf(dot_output, "digraph G {\n");
     fprintf(dot_output, "\tnode [shape=record];\n");
-    DFS_print(root, dot_output);
+    DFS_print(nodes, names, dot_output);
     fprintf(dot_output, "}\n");
     fclose(dot_output);
 }
 
-void write_node(Node *node, FILE *&output, int offset) {
-    if (!node) {
-        return;
-    }
-    std::string printf_format_string =
-            std::string(offset - 1, '\t') + "{\n" + std::string(offset, '\t') + "\"%s\" %d\n";
-    std::string printf_format_string1 = std::string(offset - 1, '\t') + "}\n";
-    fprintf(output, printf_format_string.c_str(), node->data.c_str(), node->children.size());
+// Indentation stops growing at MAX_INDENT tabs, or a deep tree would take a square of its depth in tabs.
+// The loader skips whitespace anyway.
+const int MAX_INDENT = 64;
 
-    for (auto &i : node->children) {
-        write_node(i, output, offset + 1);
+void write_node(Node *root, const Interner &names, FILE *&output, int offset) {
+    struct Frame {
+        Node *node;
+        uint32_t next;
+    };
+    std::vector<Frame> stack;
+    auto indent = [&](size_t depth) { return std::string(std::min<size_t>(depth, MAX_INDENT), '\t'); };
+    auto open = [&](Node *node) {
+        size_t depth = offset + stack.size();
+        fprintf(output, "%s{\n%s\"%s\" %d\n", indent(depth - 1).c_str(), indent(depth).c_str(),
+                node_text(node, names).c_str(), node->count);
+        stack.push_back({node, 0});
+    };
+    if (root) {
+        open(root);
+    }
+    while (!stack.empty()) {
+        Frame &top = stack.back();
+        if (top.next < top.node->count) {
+            if (Node *child = (*top.node)[top.next++]) {
+                open(child);
+            }
+            continue;
+        }
+        stack.pop_back();
+        fprintf(output, "%s}\n", indent(offset + stack.size() - 1).c_str());
     }
-    fprintf(output, "%s", printf_format_string1.c_str());
 }
 
 
-Node *DFS_load(const std::string &str, int &ptr) {
-    int i = 0;
-    int start = 0;
-    while (str[ptr] != '{') {
-        ptr++;
-    }
-    while (str[ptr] != '\"') {
-        ptr++;
-    }
-    ptr++;
-    start = ptr;
-    while (str[ptr] != '\"') {
+// Nodes of a dump, names are copied to the arena since the text of the dump goes away.
+Node *DFS_load(const std::string &str, int &ptr, Arena &arena, Interner &names) {
+    struct Frame {
+        Node node;
+        size_t left;
+        size_t mark;
+    };
+    std::vector<Frame> stack;
+    std::vector<Node *> children;
+    for (;;) {
+        int i = 0;
+        int start = 0;
+        while (str[ptr] != '{') {
+            ptr++;
+        }
+        while (str[ptr] != '\"') {
+            ptr++;
+        }
         ptr++;
-        i++;
-    }
-    std::string data = std::string((str.data() + start), i);
-    TokenType type = TokenType::NULL_TYPE;
-    ptr += 2;
-    if (data == "return" || data == "if" || data == "in" || data == "out" || data == "while" || data == "data") {
-        type = TokenType::KEYWORD;
-    } else if (isdigit(data[0])) {
-        type = TokenType::INTEGER_LITERAL;
-    } else if (data == "ARG" || data == "STAT" || data == "COMPOUND") {
-        type = TokenType::NULL_TYPE;
-    } else if (isalpha(data[0])) {
-        type = TokenType::IDENTIFICATOR;
-    } else if (data == "+" || data == "-" || data == "/" || data == "*" || data == "=" || data == "<" || data == "==") {
-        type = TokenType::OPERATOR;
-    }
-    size_t num = str[ptr];
-    Node *result = new Node(data, type);
-    for (int j = 0; j < num - '0'; ++j) {
-        result->children.push_back(DFS_load(str, ptr));
+        start = ptr;
+        while (str[ptr] != '\"') {
+            ptr++;
+            i++;
+        }
+        std::string data = std::string((str.data() + start), i);
+        Node node = {NodeKind::COMPOUND, Operator::NONE, Interner::NO_SYMBOL, 0, 0, 0, nullptr, 0};
+        ptr += 2;
+        if (auto keyword = find_keyword(data)) {
+            constexpr NodeKind KEYWORD_KINDS[] = {NodeKind::RETURN, NodeKind::IF, NodeKind::WHILE,
+                                                  NodeKind::DATA, NodeKind::IN, NodeKind::OUT};
+            node.kind = KEYWORD_KINDS[int(*keyword)];
+        } else if (isdigit(data[0]) || (data[0] == '-' && isdigit(data[1]))) {
+            node.kind = NodeKind::INTEGER_LITERAL;
+            node.value = atoll(data.c_str());
+        } else if (data == "ROOT") {
+            node.kind = NodeKind::ROOT;
+        } else if (data == "ARG") {
+            node.kind = NodeKind::ARG;
+        } else if (data == "STAT" || data == "COMPOUND") {
+            node.kind = NodeKind::COMPOUND;
+        } else if (isalpha(data[0])) {
+            node.kind = NodeKind::IDENTIFIER;
+            node.symbol = names.intern({arena.array(data.data(), data.size()), data.size()});
+        } else if ((node.op = find_operator(data)) != Operator::NONE) {
+            node.kind = NodeKind::OPERATOR;
+        }
+        size_t num = atoi(str.c_str() + ptr);
+        if (node.kind == NodeKind::IDENTIFIER && num) {
+            node.kind = NodeKind::CALL;
+        }
+        stack.push_back({node, num, children.size()});
+
+        // Nodes whose children are all read are complete and become a child of the node below.
+        while (stack.back().left == 0) {
+            Frame frame = stack.back();
+            stack.pop_back();
+            frame.node.count = children.size() - frame.mark;
+            frame.node.children = frame.node.count ? arena.array(children.data() + frame.mark, frame.node.count) : nullptr;
+            children.resize(frame.mark);
+            Node *result = arena.make(frame.node);
+            if (stack.empty()) {
+                return result;
+            }
+            children.push_back(result);
+            --stack.back().left;
+        }
     }
-    return result;
 }
 
-Node *load(const char *filename) {
+Node *load(const char *filename, Arena &arena, Interner &names) {
     int i = 0;
     std::ifstream t(filename);
     std::stringstream buffer;
     buffer << t.rdbuf();
 
 
-    Node *root = DFS_load(buffer.str(), i);
-    for (auto &i : root->children) {
-        if (i->data == "data") {
-            continue;
+    Node *root = DFS_load(buffer.str(), i, arena, names);
+    for (Node *i : *root) {
+        if (i->kind == NodeKind::CALL) {
+            i->kind = NodeKind::FUNCTION;
         }
-        i->type = TokenType::FUNCTION;
     }
     return root;
 }
 
 
-std::map<std::string, Keyword> prepare_keywords() {
-    static const std::map<std::string, Keyword> keywords = {
-            {"return", Keyword::RETURN},
-            {"if",     Keyword::IF},
-            {"while",  Keyword::WHILE},
-            {"data",   Keyword::DATA},
-            {"in",     Keyword::IN},
-            {"out",    Keyword::OUT}
-    };
-    return keywords;
+// Read-only mapping of the whole file, tokens and names point into it until the program ends.
+std::string_view map_source(const char *file_name) {
+    int input = open(file_name, O_RDONLY);
+    if (input < 0) {
+        fprintf(stderr, "Can't open %s\n", file_name);
+        exit(1);
+    }
+    struct stat info = {};
+    fstat(input, &info);
+    std::string_view text;
+    if (info.st_size > 0) {
+        void *mapped = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, input, 0);
+        if (mapped == MAP_FAILED) {
+            fprintf(stderr, "Can't map %s\n", file_name);
+            exit(1);
+        }
+        madvise(mapped, info.st_size, MADV_SEQUENTIAL);
+        text = std::string_view((const char *) mapped, info.st_size);
+    }
+    close(input);
+    return text;
 }
 
 const std::string HELP_STRING = "Invalid number of arguments. Expected 3.\n"
-                                "[input_file] [asm_output] [AST_img]\n";
+                                "[-c] [input_file] [asm_output] [AST_img]\n"
+                                "-c writes an object instead of ASM, as ASM/compile -c would make of it\n"
+                                "--time-report[=json] prints time, memory and counts of every phase to stderr\n";
 
 int main(int argc, char *argv[]) {
-    if (argc != 4) {
+    bool object = false;
+    auto report_format = TimeReport::Format::NONE;
+    const option long_options[] = {
+            {"time-report", optional_argument, nullptr, 't'},
+            {nullptr, 0, nullptr, 0}
+    };
+    int key = 0;
+    while ((key = getopt_long(argc, argv, "c", long_options, nullptr)) != -1) {
+        switch (key) {
+            case 'c':
+                object = true;
+                break;
+            case 't':
+                if (optarg && strcmp(optarg, "json") != 0) {
+                    fprintf(stderr, "Unknown report format %s, only json is known\n", optarg);
+                    return 1;
+                }
+                report_format = optarg ? TimeReport::Format::JSON : TimeReport::Format::TEXT;
+                break;
+        }
+    }
+    if (argc - optind != 3) {
         std::cout << HELP_STRING << std::endl;
         return 1;
     }
+    const char *input_file = argv[optind];
+    const char *output_file = argv[optind + 1];
+    const char *image_file = argv[optind + 2];
+
+    TimeReport report(report_format);
 
-    auto keywords = prepare_keywords();
-    std::ifstream reader(argv[1]);
-    std::stringstream input;
-    input << reader.rdbuf();
-    Lexer lexer(input.str(), keywords);
-    auto tokens = lexer.separate_tokens();
+    // The lexer hands tokens to the parser one by one, the two are timed together.
+    report.begin("parse");
+    Lexer lexer(map_source(input_file));
+    AST tree(lexer);
+    Node *root = tree.get_root();
+    report.end();
+    report.count("tokens", lexer.get_token_count());
+    report.count("nodes", tree.get_node_count());
+    report.count("symbols", tree.get_names().size());
 
-    Node *root = AST(tokens, keywords).get_root();
-    auto char_table = Semantic(root, keywords).get_symbol_table();
-    ASMTranslator(argv[2], root, char_table);
+    report.begin("semantic");
+    auto char_table = Semantic(root, tree.get_names()).get_symbol_table();
+    report.end();
+    report.count("globals", char_table.global_var);
+    report.count("max_locals", char_table.max_var);
 
-    auto tree_dot = std::string(argv[3]) + ".dot";
-    auto tree_svg = std::string(argv[3]) + ".svg";
-    auto tree_dump = std::string(argv[3]) + ".dump";
-    print_dot(tree_dot.c_str(), root);
+    report.begin("codegen");
+    size_t instructions = ASMTranslator(output_file, root, tree.get_names(), char_table, object).get_instruction_count();
+    report.end();
+    report.count("instructions", instructions);
 
+    auto tree_dot = std::string(image_file) + ".dot";
+    auto tree_svg = std::string(image_file) + ".svg";
+    auto tree_dump = std::string(image_file) + ".dump";
+    report.begin("dot");
+    print_dot(tree_dot.c_str(), root, tree.get_names());
+    report.end();
+
+    report.begin("svg");
     auto command = "dot -Tsvg -o " + tree_svg + " " + tree_dot;
-    system(command.c_str());
+    int status = system(command.c_str());
+    report.end();
+    if (status != 0) {
+        report.fail(status != -1 && WIFEXITED(status) ? WEXITSTATUS(status) : status);
+    }
 
+    report.begin("dump");
     FILE *dump = fopen(tree_dump.c_str(), "w");
-    write_node(root, dump, 1);
+    write_node(root, tree.get_names(), dump, 1);
     fclose(dump);
+    report.end();
 }
\ No newline at end of file